@@ -0,0 +1,267 @@
+#include "sdf.h"
+
+#include <random>
+
+// Microbenchmarks for the hot paths, written to stdout as JSON:
+//
+//   {"threads": 8,
+//    "benchmarks": [{"name": "...", "value": 1.5e7, "unit": "points/s"}, ...]}
+//
+// Inputs come from fixed seeds and every result is the best of kRuns timed
+// runs, so two builds can be compared result by result. Evaluation and
+// marching run on one thread; mesh/*/build (parallel ingest and embree's
+// BVH builder) and stl/save (parallel encoding) use every hardware thread,
+// so threads is recorded alongside and results are only comparable between
+// machines with the same count.
+
+const int kRuns = 5;
+
+// each timed run repeats its work until at least this long has passed
+const double kMinRunTime = 0.1;
+
+struct Result {
+    std::string name;
+    double value;
+    std::string unit;
+};
+
+std::vector<Result> results;
+
+void Report(const std::string &name, const double value, const std::string &unit) {
+    fprintf(stderr, "  %-32s %12.4g %s\n", name.c_str(), value, unit.c_str());
+    results.push_back({name, value, unit});
+}
+
+// returns the best rate of func, which does amount units of work per call
+double Rate(const double amount, const std::function<void()> &func) {
+    double best = 0;
+    for (int run = 0; run < kRuns; run++) {
+        int calls = 0;
+        const auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            func();
+            calls++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < kMinRunTime);
+        best = std::max(best, amount * calls / elapsed.count());
+    }
+    return best;
+}
+
+// returns the best wall time of a single call of func
+double Seconds(const std::function<void()> &func) {
+    double best = std::numeric_limits<double>::infinity();
+    for (int run = 0; run < kRuns; run++) {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// lattice points of the box [lo, hi), in x-fastest order like the mesher
+std::vector<vec3> LatticePoints(const ivec3 &lo, const ivec3 &hi) {
+    std::vector<vec3> points;
+    for (int z = lo.z; z < hi.z; z++) {
+        for (int y = lo.y; y < hi.y; y++) {
+            for (int x = lo.x; x < hi.x; x++) {
+                points.emplace_back(x, y, z);
+            }
+        }
+    }
+    return points;
+}
+
+// triangles of a unit sphere with slices * stacks * 2 faces (less the
+// degenerate ones at the poles)
+std::vector<vec3> SphereTriangles(const int slices, const int stacks) {
+    const auto point = [&](const int i, const int j) {
+        const real theta = 2 * M_PI * i / slices;
+        const real phi = M_PI * j / stacks;
+        return vec3(std::cos(theta) * std::sin(phi), std::sin(theta) * std::sin(phi), std::cos(phi));
+    };
+    std::vector<vec3> points;
+    for (int j = 0; j < stacks; j++) {
+        for (int i = 0; i < slices; i++) {
+            const vec3 a = point(i, j);
+            const vec3 b = point(i + 1, j);
+            const vec3 c = point(i + 1, j + 1);
+            const vec3 d = point(i, j + 1);
+            if (j > 0) {
+                points.insert(points.end(), {a, d, b});
+            }
+            if (j < stacks - 1) {
+                points.insert(points.end(), {b, d, c});
+            }
+        }
+    }
+    return points;
+}
+
+void BenchPrimitives(const std::vector<vec3> &points) {
+    const std::vector<std::pair<std::string, SDF3>> primitives = {
+        {"sphere", Sphere(40)},
+        {"cylinder", Cylinder(20)},
+        {"plane", Plane(glm::normalize(vec3(1, 2, 3)))},
+        {"box", Box(vec3(30, 40, 50))},
+    };
+    std::vector<real> out(points.size());
+    for (const auto &primitive : primitives) {
+        const Tape tape(primitive.second);
+        Report("primitive/" + primitive.first + "/batch", Rate(points.size(), [&]() {
+            tape.Evaluate(points.data(), out.data(), points.size());
+        }), "points/s");
+        Report("primitive/" + primitive.first + "/point", Rate(points.size(), [&]() {
+            for (int i = 0; i < points.size(); i++) {
+                out[i] = tape(points[i]);
+            }
+        }), "points/s");
+    }
+}
+
+void BenchCSG(const std::vector<vec3> &points) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<real> coordinate(-40, 40);
+    std::uniform_real_distribution<real> radius(5, 20);
+    std::vector<real> out(points.size());
+    SDF3 f = Sphere(radius(rng), vec3(coordinate(rng), coordinate(rng), coordinate(rng)));
+    for (int depth = 1; depth <= 64; depth++) {
+        const SDF3 g = Translate(
+            Rotate(Box(vec3(radius(rng))), coordinate(rng), glm::normalize(vec3(1, 2, 3))),
+            vec3(coordinate(rng), coordinate(rng), coordinate(rng)));
+        f = depth % 3 == 0 ? f - g : depth % 3 == 1 ? f | g : f & (g + vec3(0, 0, 1));
+        if ((depth & (depth - 1)) != 0) {
+            continue;
+        }
+        const Tape tape(f);
+        const std::string name = "csg/depth" + std::to_string(depth);
+        Report(name + "/batch", Rate(points.size(), [&]() {
+            tape.Evaluate(points.data(), out.data(), points.size());
+        }), "points/s");
+        Report(name + "/batch_float", Rate(points.size(), [&]() {
+            thread_local std::vector<float> floats;
+            floats.resize(points.size());
+            tape.Evaluate(points.data(), floats.data(), points.size());
+        }), "points/s");
+    }
+}
+
+void BenchMesh(const RTCDevice device, const std::string &dir) {
+    // Mesh places the unit sphere at radius 20 around this center; queries
+    // are a block of lattice points straddling its top
+    const ivec3 center(0, 0, -510);
+    const ivec3 top = center + ivec3(0, 0, 20);
+    const std::vector<vec3> points = LatticePoints(top - 8, top + 8);
+    std::vector<real> out(points.size());
+    for (const int slices : {64, 256, 1024}) {
+        const std::vector<vec3> triangles = SphereTriangles(slices, slices / 2);
+        const std::string path = dir + "/sphere" + std::to_string(slices) + ".stl";
+        SaveBinarySTL(path, triangles);
+        const std::string name = "mesh/" + std::to_string(triangles.size() / 3);
+
+        Report(name + "/build", Seconds([&]() {
+            Mesh(device, path);
+        }), "s");
+
+        const Tape tape(Mesh(device, path));
+        Report(name + "/query", Rate(points.size(), [&]() {
+            tape.Evaluate(points.data(), out.data(), points.size());
+        }), "points/s");
+    }
+}
+
+void BenchMarching() {
+    // a sphere sampled on a lattice, so most cells are cut at realistic angles
+    const int n = 64;
+    const Tape tape(Sphere(n * 0.45) - Box(vec3(n * 0.2)));
+    const std::vector<vec3> points = LatticePoints(ivec3(-n / 2), ivec3(n / 2 + 1));
+    std::vector<real> values(points.size());
+    tape.Evaluate(points.data(), values.data(), points.size());
+
+    const int m = n + 1;
+    std::vector<vec3> triangles;
+    const double numCells = double(n) * n * n;
+    Report("marching_cubes", Rate(numCells, [&]() {
+        triangles.clear();
+        std::array<vec3, 8> p;
+        std::array<real, 8> v;
+        for (int z = 0; z < n; z++) {
+            for (int y = 0; y < n; y++) {
+                for (int x = 0; x < n; x++) {
+                    for (int i = 0; i < 8; i++) {
+                        const ivec3 c = ivec3(x, y, z) + kCellCorners[i];
+                        const int j = (c.z * m + c.y) * m + c.x;
+                        p[i] = points[j];
+                        v[i] = values[j];
+                    }
+                    MarchingCubes(p, v, 0, triangles);
+                }
+            }
+        }
+    }), "cells/s");
+
+    const ivec3 lo(-n / 2);
+    const ivec3 hi(n / 2);
+    for (const Extractor extractor : {Extractor::MarchingCubes, Extractor::DualContouring}) {
+        TriangleSoup soup;
+        const std::string name = extractor == Extractor::MarchingCubes ?
+            "mesh_octree/marching_cubes" : "mesh_octree/dual_contouring";
+        Report(name, Rate(numCells, [&]() {
+            soup.points.clear();
+            soup.colors.clear();
+            MeshOctree(tape, lo, hi, soup, Precision::Double, extractor);
+        }), "cells/s");
+    }
+}
+
+void BenchSTL(const std::string &dir) {
+    const std::vector<vec3> points = SphereTriangles(2048, 1024);
+    const std::vector<vec3> colors(points.size() / 3, vec3(1, 0, 0));
+    const std::string path = dir + "/io.stl";
+    const double megabytes = (points.size() / 3 * 50 + 84) / 1e6;
+    Report("stl/save", Rate(megabytes, [&]() {
+        SaveBinarySTL(path, points, colors);
+    }), "MB/s");
+    Report("stl/load", Rate(megabytes, [&]() {
+        LoadBinarySTL(path);
+    }), "MB/s");
+}
+
+int main() {
+    const std::string dir = (std::filesystem::temp_directory_path() / "sdf-bench").string();
+    std::filesystem::create_directories(dir);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<real> coordinate(-64, 64);
+    std::vector<vec3> points(1 << 16);
+    for (vec3 &p : points) {
+        p = vec3(coordinate(rng), coordinate(rng), coordinate(rng));
+    }
+
+    fprintf(stderr, "primitives\n");
+    BenchPrimitives(points);
+    fprintf(stderr, "csg\n");
+    BenchCSG(points);
+    fprintf(stderr, "mesh\n");
+    RTCDevice device = rtcNewDevice(NULL);
+    BenchMesh(device, dir);
+    fprintf(stderr, "marching\n");
+    BenchMarching();
+    fprintf(stderr, "stl\n");
+    BenchSTL(dir);
+
+    std::filesystem::remove_all(dir);
+
+    printf("{\n  \"threads\": %u,\n  \"benchmarks\": [\n", std::thread::hardware_concurrency());
+    for (int i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        printf("    {\"name\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}%s\n",
+            r.name.c_str(), r.value, r.unit.c_str(),
+            i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+// Quadric error decimation (Garland and Heckbert) of one tile's triangles.
+//
+// Every vertex carries the sum of the squared-distance quadrics of the planes
+// of its original triangles, and edges are collapsed cheapest first, so flat
+// regions thin out while creases, whose planes disagree, are kept. Tiles are
+// decimated on their own: the tile's open border, where its triangles meet
+// the neighboring tiles', is locked, so tiles still join without cracks.
+// Vertices where two colors meet may only slide along the color boundary and
+// vertices where three or more meet are locked.
+
+struct DecimateOptions {
+    // stop once this fraction of the tile's triangles remains
+    real ratio = 0;
+
+    // never collapse an edge whose quadric error, a bound on how far the
+    // merged vertex is from any of the planes it came from, exceeds this
+    real maxError = std::numeric_limits<real>::infinity();
+};
+
+// collapses may not turn a triangle's normal by more than about 75 degrees
+const real kMinNormalDot = 0.25;
+
+// symmetric 4x4 matrix of the plane equation products
+class Quadric {
+public:
+    Quadric() : m_Q{} {}
+
+    // plane through p with unit normal n
+    Quadric(const vec3 &n, const vec3 &p) {
+        const real d = -glm::dot(n, p);
+        m_Q = {
+            n.x * n.x, n.x * n.y, n.x * n.z, n.x * d,
+            n.y * n.y, n.y * n.z, n.y * d,
+            n.z * n.z, n.z * d,
+            d * d,
+        };
+    }
+
+    Quadric &operator+=(const Quadric &q) {
+        for (int i = 0; i < m_Q.size(); i++) {
+            m_Q[i] += q.m_Q[i];
+        }
+        return *this;
+    }
+
+    Quadric operator+(const Quadric &q) const {
+        Quadric result = *this;
+        return result += q;
+    }
+
+    real Error(const vec3 &p) const {
+        const auto &q = m_Q;
+        return
+            q[0] * p.x * p.x + 2 * q[1] * p.x * p.y + 2 * q[2] * p.x * p.z + 2 * q[3] * p.x +
+            q[4] * p.y * p.y + 2 * q[5] * p.y * p.z + 2 * q[6] * p.y +
+            q[7] * p.z * p.z + 2 * q[8] * p.z +
+            q[9];
+    }
+
+    // the point of least error, if the planes pin one down
+    bool Minimize(vec3 &p) const {
+        const auto &q = m_Q;
+        const mat3 a(q[0], q[1], q[2], q[1], q[4], q[5], q[2], q[5], q[7]);
+        if (std::abs(glm::determinant(a)) < 1e-9) {
+            return false;
+        }
+        p = glm::inverse(a) * -vec3(q[3], q[6], q[8]);
+        return true;
+    }
+
+private:
+    std::array<real, 10> m_Q;
+};
+
+void Decimate(TriangleSoup &soup, const DecimateOptions &options) {
+    const int numTriangles = soup.colors.size();
+    if (numTriangles == 0) {
+        return;
+    }
+
+    // weld equal points; the extractors compute shared vertices bit-identically
+    std::vector<vec3> positions;
+    std::vector<std::array<int, 3>> triangles(numTriangles);
+    std::unordered_map<vec3, int> lookup;
+    for (int i = 0; i < soup.points.size(); i++) {
+        const auto it = lookup.emplace(soup.points[i], positions.size());
+        if (it.second) {
+            positions.push_back(soup.points[i]);
+        }
+        triangles[i / 3][i % 3] = it.first->second;
+    }
+    lookup.clear();
+    const int numVertices = positions.size();
+
+    std::vector<std::vector<int>> around(numVertices);
+    for (int t = 0; t < numTriangles; t++) {
+        for (const int v : triangles[t]) {
+            around[v].push_back(t);
+        }
+    }
+
+    const auto normal = [&](const int t) {
+        const auto &tri = triangles[t];
+        const vec3 n = glm::cross(
+            positions[tri[1]] - positions[tri[0]],
+            positions[tri[2]] - positions[tri[0]]);
+        const real length = glm::length(n);
+        return length > 0 ? n / length : vec3{0};
+    };
+
+    const auto contains = [&](const int t, const int v) {
+        const auto &tri = triangles[t];
+        return tri[0] == v || tri[1] == v || tri[2] == v;
+    };
+
+    // the triangles on edge uw
+    const auto edgeTriangles = [&](const int u, const int w, std::vector<int> &out) {
+        out.clear();
+        for (const int t : around[u]) {
+            if (contains(t, w)) {
+                out.push_back(t);
+            }
+        }
+    };
+
+    // free vertices move anywhere, border vertices along their color
+    // boundary, locked vertices not at all
+    enum { kFree, kBorder, kLocked };
+    std::vector<uint8_t> state(numVertices, kFree);
+    std::vector<Quadric> quadrics(numVertices);
+    std::vector<int> edge;
+    for (int u = 0; u < numVertices; u++) {
+        std::vector<vec3> colors;
+        for (const int t : around[u]) {
+            const vec3 n = normal(t);
+            if (n != vec3{0}) {
+                quadrics[u] += Quadric(n, positions[u]);
+            }
+            if (std::find(colors.begin(), colors.end(), soup.colors[t]) == colors.end()) {
+                colors.push_back(soup.colors[t]);
+            }
+            for (const int w : triangles[t]) {
+                if (w == u) {
+                    continue;
+                }
+                edgeTriangles(u, w, edge);
+                if (edge.size() != 2) {
+                    // tile border, or a non-manifold edge
+                    state[u] = kLocked;
+                } else if (soup.colors[edge[0]] != soup.colors[edge[1]]) {
+                    // planes through the color boundary, perpendicular to
+                    // the surface, keep border vertices on it; each edge
+                    // is seen twice from u, once per triangle
+                    const vec3 e = glm::normalize(positions[w] - positions[u]);
+                    const vec3 n = glm::cross(e, normal(t));
+                    if (n != vec3{0}) {
+                        quadrics[u] += Quadric(glm::normalize(n), positions[u]);
+                    }
+                }
+            }
+        }
+        if (colors.size() > 2) {
+            state[u] = kLocked;
+        } else if (colors.size() == 2 && state[u] == kFree) {
+            state[u] = kBorder;
+        }
+    }
+
+    struct Collapse {
+        real cost;
+        int u;
+        int w;
+        int uStamp;
+        int wStamp;
+        vec3 p;
+
+        bool operator<(const Collapse &c) const {
+            return cost > c.cost;
+        }
+    };
+
+    std::vector<int> stamps(numVertices, 0);
+    std::priority_queue<Collapse> queue;
+    const real maxCost = options.maxError * options.maxError;
+
+    // plans the collapse of edge uw, choosing where the merged vertex goes
+    const auto plan = [&](const int u, const int w) {
+        edgeTriangles(u, w, edge);
+        const bool colorEdge = edge.size() == 2 &&
+            soup.colors[edge[0]] != soup.colors[edge[1]];
+        const auto fixed = [&](const int v) {
+            return state[v] == kLocked || (state[v] == kBorder && !colorEdge);
+        };
+        if (fixed(u) && fixed(w)) {
+            return;
+        }
+        const Quadric q = quadrics[u] + quadrics[w];
+        vec3 p;
+        if (fixed(u)) {
+            p = positions[u];
+        } else if (fixed(w)) {
+            p = positions[w];
+        } else {
+            // nearly singular quadrics (creases) can put the minimum far
+            // along the crease, so fall back to the best of the edge
+            const vec3 mid = (positions[u] + positions[w]) / real(2);
+            const real length = glm::distance(positions[u], positions[w]);
+            if (!q.Minimize(p) || glm::distance(p, mid) > length) {
+                p = mid;
+                for (const vec3 &c : {positions[u], positions[w]}) {
+                    if (q.Error(c) < q.Error(p)) {
+                        p = c;
+                    }
+                }
+            }
+        }
+        const real cost = std::max(q.Error(p), real(0));
+        if (cost <= maxCost) {
+            queue.push({cost, u, w, stamps[u], stamps[w], p});
+        }
+    };
+
+    const auto neighbors = [&](const int u, std::vector<int> &out) {
+        out.clear();
+        for (const int t : around[u]) {
+            for (const int v : triangles[t]) {
+                if (v != u && std::find(out.begin(), out.end(), v) == out.end()) {
+                    out.push_back(v);
+                }
+            }
+        }
+    };
+
+    std::vector<int> ring;
+    std::vector<int> otherRing;
+    for (int u = 0; u < numVertices; u++) {
+        neighbors(u, ring);
+        for (const int w : ring) {
+            if (u < w) {
+                plan(u, w);
+            }
+        }
+    }
+
+    // rejects collapses that pinch the surface or fold triangles over
+    const auto valid = [&](const Collapse &c) {
+        neighbors(c.u, ring);
+        neighbors(c.w, otherRing);
+        int shared = 0;
+        for (const int v : ring) {
+            if (std::find(otherRing.begin(), otherRing.end(), v) != otherRing.end()) {
+                shared++;
+            }
+        }
+        if (shared != 2) {
+            return false;
+        }
+        for (const int v : {c.u, c.w}) {
+            for (const int t : around[v]) {
+                if (contains(t, c.u) && contains(t, c.w)) {
+                    continue;
+                }
+                std::array<vec3, 3> p;
+                for (int k = 0; k < 3; k++) {
+                    const int x = triangles[t][k];
+                    p[k] = x == c.u || x == c.w ? c.p : positions[x];
+                }
+                const vec3 n = glm::cross(p[1] - p[0], p[2] - p[0]);
+                const real length = glm::length(n);
+                const vec3 before = normal(t);
+                if (length == 0 ||
+                    (before != vec3{0} && glm::dot(n / length, before) < kMinNormalDot))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    const int target = std::ceil(options.ratio * numTriangles);
+    int remaining = numTriangles;
+    std::vector<bool> removed(numTriangles, false);
+    while (remaining > target && !queue.empty()) {
+        const Collapse c = queue.top();
+        queue.pop();
+        if (stamps[c.u] != c.uStamp || stamps[c.w] != c.wStamp ||
+            around[c.u].empty() || around[c.w].empty() || !valid(c))
+        {
+            continue;
+        }
+
+        // u merges into w
+        for (const int t : around[c.u]) {
+            auto &tri = triangles[t];
+            if (contains(t, c.w)) {
+                removed[t] = true;
+                remaining--;
+                for (const int v : tri) {
+                    if (v != c.u) {
+                        auto &list = around[v];
+                        list.erase(std::find(list.begin(), list.end(), t));
+                    }
+                }
+            } else {
+                *std::find(tri.begin(), tri.end(), c.u) = c.w;
+                around[c.w].push_back(t);
+            }
+        }
+        around[c.u].clear();
+        positions[c.w] = c.p;
+        quadrics[c.w] += quadrics[c.u];
+        state[c.w] = std::max(state[c.u], state[c.w]);
+        stamps[c.u]++;
+        stamps[c.w]++;
+
+        neighbors(c.w, ring);
+        const std::vector<int> wRing = ring;
+        for (const int v : wRing) {
+            plan(c.w, v);
+        }
+    }
+
+    soup.points.clear();
+    std::vector<vec3> colors;
+    colors.swap(soup.colors);
+    for (int t = 0; t < numTriangles; t++) {
+        if (!removed[t]) {
+            for (const int v : triangles[t]) {
+                soup.points.push_back(positions[v]);
+            }
+            soup.colors.push_back(colors[t]);
+        }
+    }
+}
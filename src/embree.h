@@ -8,6 +8,82 @@ typedef struct {
     int v0, v1, v2;
 } EmbreeTriangle;
 
+// a unit vector in 4 bytes: octahedral coordinates as two 16-bit fixed
+// point numbers, good to about 1e-4 radians
+struct PackedNormal {
+    int16_t u, v;
+};
+
+PackedNormal PackNormal(const vec3 &n) {
+    const real l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (!(l1 > 0)) {
+        return PackedNormal{0, 0};
+    }
+    real u = n.x / l1;
+    real v = n.y / l1;
+    if (n.z < 0) {
+        const real fu = (1 - std::abs(v)) * (u < 0 ? -1 : 1);
+        const real fv = (1 - std::abs(u)) * (v < 0 ? -1 : 1);
+        u = fu;
+        v = fv;
+    }
+    return PackedNormal{int16_t(std::round(u * 32767)), int16_t(std::round(v * 32767))};
+}
+
+vec3 UnpackNormal(const PackedNormal &p) {
+    const real u = p.u / real(32767);
+    const real v = p.v / real(32767);
+    vec3 n(u, v, 1 - std::abs(u) - std::abs(v));
+    if (n.z < 0) {
+        n.x = (1 - std::abs(v)) * (u < 0 ? -1 : 1);
+        n.y = (1 - std::abs(u)) * (v < 0 ? -1 : 1);
+    }
+    return glm::normalize(n);
+}
+
+// The geometry of a Mesh, shared by every SDF3 (and Tape) built from it and
+// freed with the last one, scene included. Embree reads the vertex and
+// index arrays in place rather than keeping copies.
+class MeshBuffers {
+public:
+    MeshBuffers() = default;
+    MeshBuffers(const MeshBuffers &) = delete;
+    MeshBuffers &operator=(const MeshBuffers &) = delete;
+
+    ~MeshBuffers() {
+        if (scene) {
+            rtcReleaseScene(scene);
+        }
+    }
+
+    vec3 Normal(const int i) const {
+        if (!packedNormals.empty()) {
+            return UnpackNormal(packedNormals[i]);
+        }
+        const EmbreeVertex &n = normals[i];
+        return vec3(n.x, n.y, n.z);
+    }
+
+    size_t Bytes() const {
+        return
+            vertices.capacity() * sizeof(EmbreeVertex) +
+            triangles.capacity() * sizeof(EmbreeTriangle) +
+            normals.capacity() * sizeof(EmbreeVertex) +
+            packedNormals.capacity() * sizeof(PackedNormal);
+    }
+
+    // one more vertex than the mesh has: embree loads vertices 16 bytes
+    // at a time
+    std::vector<EmbreeVertex> vertices;
+    std::vector<EmbreeTriangle> triangles;
+
+    // pseudonormals per vertex, in one of the two forms
+    std::vector<EmbreeVertex> normals;
+    std::vector<PackedNormal> packedNormals;
+
+    RTCScene scene = nullptr;
+};
+
 std::pair<vec3, vec3> closestPointTriangle(
     const vec3 &p,
     const vec3 &a, const vec3 &b, const vec3 &c,
@@ -71,153 +147,515 @@ struct ClosestPointResult {
     unsigned int primID;
     unsigned int geomID;
 
-    EmbreeVertex *vertexBuf;
-    EmbreeTriangle *triangleBuf;
-    EmbreeVertex *normalBuf;
-};
+    const MeshBuffers *mesh;
 
-SDF3 Mesh(const RTCDevice device, const std::string &path) {
-    // load the stl
-    const std::vector<vec3> data = LoadBinarySTL(path);
+    // closest point on one triangle to q, and the pseudonormal there
+    std::pair<vec3, vec3> Closest(const unsigned int primID, const vec3 &q) const {
+        const EmbreeTriangle &triangle = mesh->triangles[primID];
+        const EmbreeVertex &v0 = mesh->vertices[triangle.v0];
+        const EmbreeVertex &v1 = mesh->vertices[triangle.v1];
+        const EmbreeVertex &v2 = mesh->vertices[triangle.v2];
+        const vec3 a(v0.x, v0.y, v0.z);
+        const vec3 b(v1.x, v1.y, v1.z);
+        const vec3 c(v2.x, v2.y, v2.z);
+        return closestPointTriangle(q, a, b, c,
+            mesh->Normal(triangle.v0), mesh->Normal(triangle.v1), mesh->Normal(triangle.v2));
+    }
 
-    // deduplicate vertices
-    std::vector<vec3> positions;
-    std::vector<ivec3> triangles;
-    std::unordered_map<vec3, int> lookup;
-    for (const vec3 &v : data) {
-        if (lookup.find(v) == lookup.end()) {
-            lookup[v] = positions.size();
-            positions.push_back(v);
+    // keeps primID if it is closer to q than the current result
+    bool Update(const unsigned int primID, const vec3 &q, real &radius) {
+        const auto closest = Closest(primID, q);
+        const vec3 p = closest.first;
+        const vec3 n = closest.second;
+        const real d = glm::distance(p, q);
+        if (d < radius) {
+            radius = d;
+            this->p = p;
+            this->d = d;
+            if (glm::dot(q - p, n) < 0) {
+                this->d = -d;
+            }
+            this->primID = primID;
+            return true;
         }
+        return false;
     }
+};
 
-    // create triangles
-    for (int i = 0; i < data.size(); i += 3) {
-        const int i0 = lookup[data[i + 0]];
-        const int i1 = lookup[data[i + 1]];
-        const int i2 = lookup[data[i + 2]];
+// A batch of nearby points shares one BVH traversal: every point's closest
+// triangle lies within |d(c)| + 2r of the center c of the batch's bounding
+// sphere (radius r), so a single query at c collects the candidates and each
+// point then only tests those. Batches whose candidate set grows past
+// kMaxBatchCandidates fall back to one traversal per point.
+const int kMaxBatchCandidates = 256;
 
-        const vec3 n = glm::triangleNormal(positions[i0], positions[i1], positions[i2]);
-        if (std::isnan(n.x)) {
-            continue;
-        }
+// The distance is 1-Lipschitz, so any earlier result bounds the next query:
+// |d(q)| <= |d(p)| + |p - q|. Seeding the query radius with that bound lets
+// traversal prune from the root instead of starting at infinity. A hint
+// that turns out too small (e.g. left over from another mesh) finds nothing,
+// and the query is rerun unbounded.
+struct QueryHint {
+    vec3 p;
+    real d = std::numeric_limits<real>::infinity();
 
-        triangles.emplace_back(i0, i1, i2);
+    float Radius(const vec3 &q) const {
+        // padded so float rounding cannot exclude the closest triangle
+        return float(std::abs(d) + glm::distance(p, q)) * 1.0001f + 1e-4f;
     }
+};
+
+// When cacheDir is set, Mesh keeps a NarrowBand of exact distances there,
+// keyed by the stl's path, size and modification time and the transform
+// applied to it, and answers queries from it where it can. packNormals stores the
+// pseudonormals in 4 bytes instead of 12 (see PackedNormal).
+//
+// Loading frees each temporary as soon as it is used up, so the peak is
+// the stl data plus the welding tables, and what stays is the float
+// vertices, the indices, the normals and embree's BVH.
+SDF3 Mesh(
+    const RTCDevice device, const std::string &path,
+    const std::string &cacheDir = "", const bool packNormals = false)
+{
+    // placement of the stl in the lattice
+    const vec3 offset(0, 0, 25.5);
+    const real scale = 20;
+
+    auto done = timed("loading stl");
+    std::vector<vec3> data = LoadBinarySTL(path);
+    done();
+
+    // Vertices are welded in parallel: corners are scattered into buckets by
+    // a hash of their position, then each bucket is sorted on its own (small
+    // enough to stay in cache). A run of equal positions becomes one vertex,
+    // and its corners, now adjacent, are what the pseudonormal pass sums.
+    done = timed("welding vertices");
+    const int numCorners = data.size() / 3 * 3;
+
+    // position bits in key, position bits and corner index in key2
+    struct Corner {
+        uint64_t key;
+        uint64_t key2;
+
+        bool operator<(const Corner &other) const {
+            return key < other.key || (key == other.key && key2 < other.key2);
+        }
+
+        bool SamePosition(const Corner &other) const {
+            return key == other.key && (key2 >> 32) == (other.key2 >> 32);
+        }
+
+        int Index() const {
+            return key2 & 0xffffffff;
+        }
+
+        int Bucket(const int bits) const {
+            const uint64_t h = (key ^ (key2 >> 32) * 0x9E3779B97F4A7C15ull) * 0xC2B2AE3D27D4EB4Full;
+            return h >> (64 - bits);
+        }
+    };
 
-    // compute angle-weighted pseudonormals
-    std::vector<vec3> normals(positions.size(), vec3{0});
-    for (const ivec3 &t : triangles) {
-        const vec3 &a = positions[t.x];
-        const vec3 &b = positions[t.y];
-        const vec3 &c = positions[t.z];
-        const vec3 n = glm::triangleNormal(a, b, c);
-        const vec3 ab = glm::normalize(b - a);
-        const vec3 ac = glm::normalize(c - a);
-        const vec3 bc = glm::normalize(c - b);
-        const real thetaA = std::acos(std::clamp(glm::dot(ab, ac), real(-1), real(1)));
-        const real thetaB = std::acos(std::clamp(glm::dot(-ab, bc), real(-1), real(1)));
-        const real thetaC = std::acos(std::clamp(glm::dot(-ac, -bc), real(-1), real(1)));
-        normals[t.x] += n * thetaA;
-        normals[t.y] += n * thetaB;
-        normals[t.z] += n * thetaC;
+    const auto makeCorner = [&](const int i) {
+        // + 0 folds -0 into 0
+        const vec3 &v = data[i];
+        const float x = float(v.x) + 0;
+        const float y = float(v.y) + 0;
+        const float z = float(v.z) + 0;
+        uint32_t bits[3];
+        memcpy(&bits[0], &x, 4);
+        memcpy(&bits[1], &y, 4);
+        memcpy(&bits[2], &z, 4);
+        return Corner{
+            uint64_t(bits[0]) << 32 | bits[1],
+            uint64_t(bits[2]) << 32 | uint32_t(i)};
+    };
+
+    // about a thousand corners per bucket
+    int bucketBits = 1;
+    while (bucketBits < 24 && (numCorners >> (bucketBits + 10)) > 0) {
+        bucketBits++;
     }
-    for (int i = 0; i < normals.size(); i++) {
-        normals[i] = glm::normalize(normals[i]);
+    const int numBuckets = 1 << bucketBits;
+    const int numWorkers = std::thread::hardware_concurrency();
+
+    // count, prefix sum, scatter
+    std::vector<int> offsets(size_t(numWorkers) * numBuckets);
+    RunWorkers([&](const int wi, const int wn) {
+        int *counts = &offsets[size_t(wi) * numBuckets];
+        const int begin = int64_t(numCorners) * wi / wn;
+        const int end = int64_t(numCorners) * (wi + 1) / wn;
+        for (int i = begin; i < end; i++) {
+            counts[makeCorner(i).Bucket(bucketBits)]++;
+        }
+    }, numWorkers);
+    std::vector<int> bucketStart(numBuckets + 1);
+    int total = 0;
+    for (int b = 0; b < numBuckets; b++) {
+        bucketStart[b] = total;
+        for (int w = 0; w < numWorkers; w++) {
+            const int count = offsets[size_t(w) * numBuckets + b];
+            offsets[size_t(w) * numBuckets + b] = total;
+            total += count;
+        }
     }
+    bucketStart[numBuckets] = total;
 
-    RTCScene scene = rtcNewScene(device);
-    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    std::vector<Corner> corners(numCorners);
+    RunWorkers([&](const int wi, const int wn) {
+        int *next = &offsets[size_t(wi) * numBuckets];
+        const int begin = int64_t(numCorners) * wi / wn;
+        const int end = int64_t(numCorners) * (wi + 1) / wn;
+        for (int i = begin; i < end; i++) {
+            const Corner c = makeCorner(i);
+            corners[next[c.Bucket(bucketBits)]++] = c;
+        }
+    }, numWorkers);
 
-    // TODO: memory leaks
+    // sort and count the distinct positions of each bucket
+    std::vector<int> bucketVertices(numBuckets + 1);
+    RunWorkers([&](const int wi, const int wn) {
+        for (int b = wi; b < numBuckets; b += wn) {
+            const auto first = corners.begin() + bucketStart[b];
+            const auto last = corners.begin() + bucketStart[b + 1];
+            std::sort(first, last);
+            int count = 0;
+            for (auto it = first; it != last; ++it) {
+                count += it == first || !it->SamePosition(*(it - 1));
+            }
+            bucketVertices[b] = count;
+        }
+    }, numWorkers);
+    int numVertices = 0;
+    for (int b = 0; b < numBuckets; b++) {
+        const int count = bucketVertices[b];
+        bucketVertices[b] = numVertices;
+        numVertices += count;
+    }
 
-    EmbreeVertex *vertexBuf = (EmbreeVertex *)rtcSetNewGeometryBuffer(
-        geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
-        sizeof(EmbreeVertex), positions.size());
-    for (int i = 0; i < positions.size(); i++) {
-        const auto &p = positions[i];
-        vertexBuf[i].x = (p.x - 0) * 20;
-        vertexBuf[i].y = (p.y - 0) * 20;
-        vertexBuf[i].z = (p.z - 25.5) * 20;
+    std::vector<vec3> positions(numVertices);
+    std::vector<int> vertexOf(numCorners);
+    std::vector<int> firstCorner(numVertices + 1);
+    firstCorner[numVertices] = numCorners;
+    RunWorkers([&](const int wi, const int wn) {
+        for (int b = wi; b < numBuckets; b += wn) {
+            int vertex = bucketVertices[b] - 1;
+            for (int i = bucketStart[b]; i < bucketStart[b + 1]; i++) {
+                if (i == bucketStart[b] || !corners[i].SamePosition(corners[i - 1])) {
+                    vertex++;
+                    positions[vertex] = data[corners[i].Index()];
+                    firstCorner[vertex] = i;
+                }
+                vertexOf[corners[i].Index()] = vertex;
+            }
+        }
+    }, numWorkers);
+    std::vector<vec3>().swap(data);
+    std::vector<int>().swap(offsets);
+    std::vector<int>().swap(bucketStart);
+    std::vector<int>().swap(bucketVertices);
+    done();
+
+    // create triangles, dropping degenerate ones
+    done = timed("building triangles");
+    const std::shared_ptr<MeshBuffers> mesh = std::make_shared<MeshBuffers>();
+    const int numTriangles = numCorners / 3;
+    std::vector<uint8_t> valid(numTriangles);
+    RunWorkers([&](const int wi, const int wn) {
+        const int begin = int64_t(numTriangles) * wi / wn;
+        const int end = int64_t(numTriangles) * (wi + 1) / wn;
+        for (int i = begin; i < end; i++) {
+            const vec3 &a = positions[vertexOf[i * 3 + 0]];
+            const vec3 &b = positions[vertexOf[i * 3 + 1]];
+            const vec3 &c = positions[vertexOf[i * 3 + 2]];
+            valid[i] = !std::isnan(glm::triangleNormal(a, b, c).x);
+        }
+    });
+    mesh->triangles.reserve(std::count(valid.begin(), valid.end(), 1));
+    for (int i = 0; i < numTriangles; i++) {
+        if (valid[i]) {
+            mesh->triangles.push_back(EmbreeTriangle{
+                vertexOf[i * 3 + 0], vertexOf[i * 3 + 1], vertexOf[i * 3 + 2]});
+        }
     }
+    done();
 
-    EmbreeTriangle *triangleBuf = (EmbreeTriangle *)rtcSetNewGeometryBuffer(
-        geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
-        sizeof(EmbreeTriangle), triangles.size());
-    for (int i = 0; i < triangles.size(); i++) {
-        const auto &t = triangles[i];
-        triangleBuf[i].v0 = t.x;
-        triangleBuf[i].v1 = t.y;
-        triangleBuf[i].v2 = t.z;
+    // compute angle-weighted pseudonormals, one vertex per thread at a time
+    // so no accumulation is shared; each corner's weighted normal is worked
+    // out where it is summed rather than stored
+    done = timed("computing normals");
+    const auto cornerNormal = [&](const int corner) {
+        const int t = corner / 3;
+        const int k = corner % 3;
+        const vec3 &a = positions[vertexOf[t * 3 + 0]];
+        const vec3 &b = positions[vertexOf[t * 3 + 1]];
+        const vec3 &c = positions[vertexOf[t * 3 + 2]];
+        const vec3 &p = k == 0 ? a : k == 1 ? b : c;
+        const vec3 &q = k == 0 ? b : k == 1 ? a : a;
+        const vec3 &r = k == 0 ? c : k == 1 ? c : b;
+        const vec3 e0 = glm::normalize(q - p);
+        const vec3 e1 = glm::normalize(r - p);
+        const real theta = std::acos(std::clamp(glm::dot(e0, e1), real(-1), real(1)));
+        return glm::triangleNormal(a, b, c) * theta;
+    };
+    if (packNormals) {
+        mesh->packedNormals.resize(numVertices);
+    } else {
+        mesh->normals.resize(numVertices);
     }
+    RunWorkers([&](const int wi, const int wn) {
+        const int begin = int64_t(numVertices) * wi / wn;
+        const int end = int64_t(numVertices) * (wi + 1) / wn;
+        for (int i = begin; i < end; i++) {
+            vec3 n{0};
+            for (int j = firstCorner[i]; j < firstCorner[i + 1]; j++) {
+                const int corner = corners[j].Index();
+                if (valid[corner / 3]) {
+                    n += cornerNormal(corner);
+                }
+            }
+            n = glm::normalize(n);
+            if (packNormals) {
+                mesh->packedNormals[i] = PackNormal(n);
+            } else {
+                mesh->normals[i] = EmbreeVertex{float(n.x), float(n.y), float(n.z)};
+            }
+        }
+    });
+    std::vector<Corner>().swap(corners);
+    std::vector<int>().swap(vertexOf);
+    std::vector<int>().swap(firstCorner);
+    std::vector<uint8_t>().swap(valid);
 
-    EmbreeVertex *normalBuf = (EmbreeVertex *)malloc(sizeof(EmbreeVertex) * normals.size());
-    for (int i = 0; i < normals.size(); i++) {
-        const auto &n = normals[i];
-        normalBuf[i].x = n.x;
-        normalBuf[i].y = n.y;
-        normalBuf[i].z = n.z;
+    mesh->vertices.resize(numVertices + 1, EmbreeVertex{0, 0, 0});
+    for (int i = 0; i < numVertices; i++) {
+        const vec3 &p = positions[i];
+        mesh->vertices[i].x = (p.x - offset.x) * scale;
+        mesh->vertices[i].y = (p.y - offset.y) * scale;
+        mesh->vertices[i].z = (p.z - offset.z) * scale;
     }
+    std::vector<vec3>().swap(positions);
+    done();
+
+    done = timed("building bvh");
+    RTCScene scene = rtcNewScene(device);
+    mesh->scene = scene;
+    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    rtcSetSharedGeometryBuffer(
+        geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3,
+        mesh->vertices.data(), 0, sizeof(EmbreeVertex), numVertices);
+    rtcSetSharedGeometryBuffer(
+        geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
+        mesh->triangles.data(), 0, sizeof(EmbreeTriangle), mesh->triangles.size());
 
     const RTCPointQueryFunction closestPointFunc = [](RTCPointQueryFunctionArguments *args) -> bool {
         ClosestPointResult *result = (ClosestPointResult *)args->userPtr;
-        const EmbreeTriangle &triangle = result->triangleBuf[args->primID];
-        const EmbreeVertex &v0 = result->vertexBuf[triangle.v0];
-        const EmbreeVertex &v1 = result->vertexBuf[triangle.v1];
-        const EmbreeVertex &v2 = result->vertexBuf[triangle.v2];
-        const EmbreeVertex &n0 = result->normalBuf[triangle.v0];
-        const EmbreeVertex &n1 = result->normalBuf[triangle.v1];
-        const EmbreeVertex &n2 = result->normalBuf[triangle.v2];
-        // TODO: silly copies
-        const vec3 a(v0.x, v0.y, v0.z);
-        const vec3 b(v1.x, v1.y, v1.z);
-        const vec3 c(v2.x, v2.y, v2.z);
-        const vec3 na(n0.x, n0.y, n0.z);
-        const vec3 nb(n1.x, n1.y, n1.z);
-        const vec3 nc(n2.x, n2.y, n2.z);
         const vec3 q(args->query->x, args->query->y, args->query->z);
-        const auto closest = closestPointTriangle(q, a, b, c, na, nb, nc);
-        const vec3 p = closest.first;
-        const vec3 n = closest.second;
-        const real d = glm::distance(p, q);
-        if (d < args->query->radius) {
-            args->query->radius = d;
-            result->p = p;
-            result->d = d;
-            if (glm::dot(q - p, n) < 0) {
-                result->d = -d;
-            }
-            result->primID = args->primID;
+        real radius = args->query->radius;
+        if (result->Update(args->primID, q, radius)) {
+            args->query->radius = radius;
             result->geomID = args->geomID;
             return true;
         }
         return false;
     };
 
-    rtcSetGeometryPointQueryFunction(geom, closestPointFunc);
+    // gathers every triangle within the query radius, which stays fixed
+    const RTCPointQueryFunction candidatesFunc = [](RTCPointQueryFunctionArguments *args) -> bool {
+        std::vector<unsigned int> *candidates = (std::vector<unsigned int> *)args->userPtr;
+        candidates->push_back(args->primID);
+        return false;
+    };
+
+    // the device's memory monitor sees the BVH being allocated
+    std::atomic<int64_t> bvhBytes(0);
+    rtcSetDeviceMemoryMonitorFunction(device, [](void *ptr, const ssize_t bytes, const bool post) {
+        *(std::atomic<int64_t> *)ptr += bytes;
+        return true;
+    }, &bvhBytes);
     rtcCommitGeometry(geom);
     rtcAttachGeometry(scene, geom);
     rtcReleaseGeometry(geom);
     rtcCommitScene(scene);
+    rtcSetDeviceMemoryMonitorFunction(device, nullptr, nullptr);
+    done();
 
-    return [=](const vec3 &p) -> real {
+    const double numKept = std::max<double>(mesh->triangles.size(), 1);
+    fprintf(stderr, "  %zu triangles, %.1f bytes per triangle (%.1f buffers, %.1f bvh)\n",
+        mesh->triangles.size(),
+        (mesh->Bytes() + bvhBytes.load()) / numKept,
+        mesh->Bytes() / numKept, bvhBytes.load() / numKept);
 
+    // the solid lies within its triangles' box
+    RTCBounds bounds;
+    rtcGetSceneBounds(scene, &bounds);
+    const vec3 boundLo(bounds.lower_x, bounds.lower_y, bounds.lower_z);
+    const vec3 boundHi(bounds.upper_x, bounds.upper_y, bounds.upper_z);
+
+    const auto pointQuery = [=](const vec3 &p, const float radius) -> ClosestPointResult {
         RTCPointQuery query;
-        query.x = p.x; 
+        query.x = p.x;
         query.y = p.y;
         query.z = p.z;
-        query.radius = std::numeric_limits<float>::infinity();
+        query.radius = radius;
         query.time = 0.f;
 
         ClosestPointResult result;
-        result.vertexBuf = vertexBuf;
-        result.triangleBuf = triangleBuf;
-        result.normalBuf = normalBuf;
+        result.mesh = mesh.get();
         RTCPointQueryContext context;
         rtcInitPointQueryContext(&context);
-        rtcPointQuery(scene, &query, &context, nullptr, (void *)&result);
+        rtcPointQuery(scene, &query, &context, closestPointFunc, (void *)&result);
+        PROFILE_COUNT(EmbreeQueries, 1);
+        return result;
+    };
+
+    // exact closest point, warm-started from the hint, which is then
+    // updated to this query
+    const auto closest = [=](const vec3 &p, QueryHint &hint) -> ClosestPointResult {
+        ClosestPointResult result = pointQuery(p, hint.Radius(p));
+        if (result.primID == RTC_INVALID_GEOMETRY_ID) {
+            PROFILE_COUNT(EmbreeRetries, 1);
+            result = pointQuery(p, std::numeric_limits<float>::infinity());
+        }
         assert(result.primID != RTC_INVALID_GEOMETRY_ID || result.geomID != RTC_INVALID_GEOMETRY_ID);
+        hint.p = p;
+        hint.d = result.d;
+        return result;
+    };
+
+    // the mesher asks for points a unit apart in order, so the previous
+    // query on this thread is a close hint
+    const auto exactDistance = [=](const vec3 &p) -> real {
+        thread_local QueryHint hint;
+        return closest(p, hint).d;
+    };
+
+    const auto exactBatchDistance = [=](const vec3 *p, real *out, const int n) {
+        vec3 lo = p[0];
+        vec3 hi = p[0];
+        for (int i = 1; i < n; i++) {
+            lo = glm::min(lo, p[i]);
+            hi = glm::max(hi, p[i]);
+        }
+        const vec3 center = (lo + hi) * real(0.5);
+        const real r = glm::distance(lo, hi) * real(0.5);
+        thread_local QueryHint hint;
+        const ClosestPointResult nearest = closest(center, hint);
+
+        thread_local std::vector<unsigned int> candidates;
+        candidates.clear();
+        RTCPointQuery query;
+        query.x = center.x;
+        query.y = center.y;
+        query.z = center.z;
+        // padded so float rounding in the traversal cannot drop a candidate
+        query.radius = (std::abs(nearest.d) + 2 * r) * 1.0001f + 1e-4f;
+        query.time = 0.f;
+        RTCPointQueryContext context;
+        rtcInitPointQueryContext(&context);
+        rtcPointQuery(scene, &query, &context, candidatesFunc, (void *)&candidates);
+        PROFILE_COUNT(EmbreeQueries, 1);
+
+        if (candidates.size() > kMaxBatchCandidates) {
+            QueryHint pointHint = hint;
+            for (int i = 0; i < n; i++) {
+                out[i] = closest(p[i], pointHint).d;
+            }
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            ClosestPointResult result = nearest;
+            real radius = std::numeric_limits<real>::infinity();
+            for (const unsigned int primID : candidates) {
+                result.Update(primID, p[i], radius);
+            }
+            out[i] = result.d;
+        }
+    };
+
+    // names the mesh, for the distance cache and for incremental runs; the
+    // file's metadata stands in for its contents, which would take a pass
+    // over the whole file to hash
+    uint64_t fileKey;
+    {
+        const std::string absolute = std::filesystem::absolute(path).string();
+        const uint64_t size = std::filesystem::file_size(path);
+        const int64_t time = std::filesystem::last_write_time(path).time_since_epoch().count();
+        fileKey = HashBytes(absolute.data(), absolute.size());
+        fileKey = HashBytes(&size, sizeof(size), fileKey);
+        fileKey = HashBytes(&time, sizeof(time), fileKey);
+        fileKey = HashBytes(&offset, sizeof(offset), fileKey);
+        fileKey = HashBytes(&scale, sizeof(scale), fileKey);
+        fileKey = HashBytes(&packNormals, sizeof(packNormals), fileKey);
+    }
+
+    if (cacheDir.empty()) {
+        return SDF3(exactDistance, exactBatchDistance)
+            .Bounds(boundLo, boundHi).Key(fileKey);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.band", (unsigned long long)fileKey);
+    const std::string cachePath = (std::filesystem::path(cacheDir) / name).string();
+
+    done = timed("loading distance cache");
+    std::shared_ptr<const NarrowBand> band = NarrowBand::Load(cachePath, fileKey);
+    done();
+    if (!band) {
+        done = timed("building distance cache");
+        const int pad = NarrowBand::kBrickSize;
+        const ivec3 lo = ivec3(glm::floor(boundLo)) - pad;
+        const ivec3 hi = ivec3(glm::ceil(boundHi)) + pad;
+        // a directory that cannot be made shows up as Build failing
+        std::error_code error;
+        std::filesystem::create_directories(cacheDir, error);
+        band = NarrowBand::Build(cachePath, fileKey, lo, hi, exactBatchDistance);
+        done();
+    }
+    if (!band) {
+        fprintf(stderr, "  could not write the distance cache to %s, meshing without it\n",
+            cacheDir.c_str());
+        return SDF3(exactDistance, exactBatchDistance)
+            .Bounds(boundLo, boundHi).Key(fileKey);
+    }
+
+    const auto distance = [=](const vec3 &p) -> real {
+        real d;
+        if (band->Lookup(p, d)) {
+            PROFILE_COUNT(NarrowBandHits, 1);
+            return d;
+        }
+        PROFILE_COUNT(NarrowBandMisses, 1);
+        return exactDistance(p);
+    };
 
-        return result.d;
+    const auto batchDistance = [=](const vec3 *p, real *out, const int n) {
+        std::array<vec3, NarrowBand::kQueryBatch> misses;
+        std::array<int, NarrowBand::kQueryBatch> missIndex;
+        std::array<real, NarrowBand::kQueryBatch> missDistance;
+        int numMisses = 0;
+        const auto flush = [&]() {
+            exactBatchDistance(misses.data(), missDistance.data(), numMisses);
+            for (int j = 0; j < numMisses; j++) {
+                out[missIndex[j]] = missDistance[j];
+            }
+            numMisses = 0;
+        };
+        for (int i = 0; i < n; i++) {
+            if (band->Lookup(p[i], out[i])) {
+                PROFILE_COUNT(NarrowBandHits, 1);
+                continue;
+            }
+            PROFILE_COUNT(NarrowBandMisses, 1);
+            misses[numMisses] = p[i];
+            missIndex[numMisses] = i;
+            if (++numMisses == misses.size()) {
+                flush();
+            }
+        }
+        if (numMisses > 0) {
+            flush();
+        }
     };
+
+    return SDF3(distance, batchDistance).Bounds(boundLo, boundHi).Key(fileKey);
 }
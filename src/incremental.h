@@ -0,0 +1,258 @@
+#pragma once
+
+// A TileCache keeps each tile's triangles in a directory from one run to the
+// next, named by a key of everything the tile's mesh depends on, so a re-run
+// after an edit only meshes the tiles the edit can reach.
+//
+// The mesher needs the sign of the distance everywhere, but its value only
+// where it is within kTileMargin of zero: crossed cell corners, dual
+// contouring's edge crossings and the Mixed refinement band all lie closer.
+// A subtree that is at least the margin outside (or inside) at every point
+// the tile reads can therefore be swapped for any other such subtree without
+// changing the tile. min, max and negation keep values beyond the margin
+// beyond it, and never pick such a subtree where the result is within it.
+// So the key hashes the SDF3 graph as the tile sees it, each such subtree
+// reduced to "outside" or "inside". Tape::Bound intervals and bounding boxes
+// over the tile find them.
+//
+// Editing one term of the model, such as moving a part or turning a cutting
+// plane, thus only changes the keys of tiles within the margin of where
+// that term's surface was or is now. Tile boxes are part of the key, so
+// callers keep tiles on a fixed grid (main aligns its lattice to the tile
+// size) rather than one that moves with the model's bounds.
+//
+// Custom nodes hash by SDF3::Key (Mesh keys itself by its input file); one
+// without a key hashes by address and so counts as changed on every run.
+//
+// Tiles that do change are meshed from the full tape, evaluating unchanged
+// subtrees too; for Mesh, the expensive one, --cache keeps those samples.
+
+class TileCache {
+public:
+    // distances at least this far from zero (in lattice units) are all
+    // alike to the mesher; above kRefineBand
+    static constexpr real kTileMargin = 2;
+
+    // part of every key; bump it whenever a change to the mesher, the
+    // extractors or the tape changes what a tile meshes to, so tiles from
+    // an older build are not reused
+    static constexpr uint32_t kVersion = 1;
+
+    // settings: a hash of anything else the tiles' triangles depend on
+    // (extractor, precision)
+    TileCache(const std::string &dir, const SDF3 &sdf, const uint64_t settings) :
+        m_Dir(dir),
+        m_Root(sdf.GetNode()),
+        m_Settings(HashBytes(&kVersion, sizeof(kVersion), settings))
+    {
+        std::filesystem::create_directories(dir);
+        HashTree(*m_Root);
+    }
+
+    TileCache(const TileCache &) = delete;
+    TileCache &operator=(const TileCache &) = delete;
+
+    // the key of the tile over the lattice cells [lo, hi)
+    uint64_t Key(const ivec3 &lo, const ivec3 &hi) const {
+        uint64_t key = HashBytes(&lo, sizeof(lo), m_Settings);
+        key = HashBytes(&hi, sizeof(hi), key);
+        // the lattice the tile reads, with dual contouring's extra step
+        // below lo and a step of slack above
+        const uint64_t tree = TileHash(*m_Root, vec3(lo - 1), vec3(hi + 1), kTileMargin);
+        return HashBytes(&tree, sizeof(tree), key);
+    }
+
+    // appends the triangles saved under key to out, or returns false if
+    // there are none
+    bool Load(const uint64_t key, TriangleSoup &out) {
+        Use(key);
+        const std::string path = PathFor(key);
+        std::ifstream file(path, std::ios_base::binary);
+        Header header;
+        std::error_code error;
+        const uintmax_t size = std::filesystem::file_size(path, error);
+        // three points and a color per triangle; checked before resizing
+        // out, so a corrupt count is a miss rather than a huge allocation
+        if (!file.read((char *)&header, sizeof(header)) ||
+            memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 ||
+            header.key != key || error ||
+            header.numTriangles != (size - sizeof(header)) / (4 * sizeof(vec3)) ||
+            (size - sizeof(header)) % (4 * sizeof(vec3)) != 0)
+        {
+            m_Misses++;
+            return false;
+        }
+        const size_t points = out.points.size();
+        const size_t colors = out.colors.size();
+        out.points.resize(points + header.numTriangles * 3);
+        out.colors.resize(colors + header.numTriangles);
+        if (!file.read((char *)(out.points.data() + points), header.numTriangles * 3 * sizeof(vec3)) ||
+            !file.read((char *)(out.colors.data() + colors), header.numTriangles * sizeof(vec3)))
+        {
+            out.points.resize(points);
+            out.colors.resize(colors);
+            m_Misses++;
+            return false;
+        }
+        m_Hits++;
+        return true;
+    }
+
+    // saves soup, one tile's triangles, under key; the file is renamed into
+    // place so an interrupted run never leaves a partial tile behind
+    void Save(const uint64_t key, const TriangleSoup &soup) const {
+        Header header;
+        memcpy(header.magic, kMagic, sizeof(header.magic));
+        header.key = key;
+        header.numTriangles = soup.colors.size();
+        const std::string path = PathFor(key);
+        const std::string temp = path + ".tmp";
+        {
+            std::ofstream file(temp, std::ios_base::binary | std::ios_base::trunc);
+            file.write((const char *)&header, sizeof(header));
+            file.write((const char *)soup.points.data(), soup.points.size() * sizeof(vec3));
+            file.write((const char *)soup.colors.data(), soup.colors.size() * sizeof(vec3));
+        }
+        std::filesystem::rename(temp, path);
+    }
+
+    // deletes the tiles this run did not ask for, so the directory holds
+    // one run's worth
+    void Prune() const {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        for (const auto &entry : std::filesystem::directory_iterator(m_Dir)) {
+            const std::filesystem::path &path = entry.path();
+            if (path.extension() != ".tile") {
+                continue;
+            }
+            const uint64_t key = std::strtoull(path.stem().string().c_str(), nullptr, 16);
+            if (m_Used.count(key) == 0) {
+                std::filesystem::remove(path);
+            }
+        }
+    }
+
+    int NumHits() const {
+        return m_Hits;
+    }
+
+    int NumMisses() const {
+        return m_Misses;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'S', 'D', 'F', 'T', 'I', 'L', 'E', '1'};
+
+    // the hashes of subtrees at least the margin outside or inside
+    static constexpr uint64_t kOutside = 0x9E3779B97F4A7C15ull;
+    static constexpr uint64_t kInside = 0xC2B2AE3D27D4EB4Full;
+
+    struct Header {
+        char magic[8];
+        uint64_t key;
+        uint64_t numTriangles;
+    };
+
+    std::string PathFor(const uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.tile", (unsigned long long)key);
+        return (std::filesystem::path(m_Dir) / name).string();
+    }
+
+    void Use(const uint64_t key) {
+        std::lock_guard<std::mutex> guard(m_Mutex);
+        m_Used.insert(key);
+    }
+
+    // a node's own operands, without children
+    static uint64_t HashOperands(const SDF3Node &node, uint64_t hash = 14695981039346656037ull) {
+        hash = HashBytes(&node.op, sizeof(node.op), hash);
+        hash = HashBytes(&node.vector, sizeof(node.vector), hash);
+        hash = HashBytes(&node.scalar, sizeof(node.scalar), hash);
+        hash = HashBytes(&node.matrix, sizeof(node.matrix), hash);
+        hash = HashBytes(&node.hasColor, sizeof(node.hasColor), hash);
+        if (node.hasColor) {
+            hash = HashBytes(&node.color, sizeof(node.color), hash);
+        }
+        if (node.op == SDF3Op::Custom) {
+            const SDF3Node *address = &node;
+            hash = node.key ?
+                HashBytes(&node.key, sizeof(node.key), hash) :
+                HashBytes(&address, sizeof(address), hash);
+        }
+        return hash;
+    }
+
+    // hashes every subtree and lowers it to a tape for its bounds, memoized
+    // by node as the graph may share them
+    uint64_t HashTree(const SDF3Node &node) {
+        const auto it = m_Hashes.find(&node);
+        if (it != m_Hashes.end()) {
+            return it->second;
+        }
+        m_Tapes[&node] = std::make_unique<Tape>(SDF3(node));
+        uint64_t hash = HashOperands(node);
+        for (const SDF3NodePtr &child : {node.a, node.b}) {
+            if (child) {
+                const uint64_t h = HashTree(*child);
+                hash = HashBytes(&h, sizeof(h), hash);
+            }
+        }
+        m_Hashes[&node] = hash;
+        return hash;
+    }
+
+    // the hash of node as seen from the box [lo, hi], given in node's frame,
+    // where distances beyond margin (in node's units) are all alike
+    uint64_t TileHash(const SDF3Node &node, vec3 lo, vec3 hi, const real margin) const {
+        Interval bound = m_Tapes.at(&node)->Bound(lo, hi);
+        // outside its bounding box the node is at least the box's distance
+        const vec3 gap = glm::max(glm::max(node.boundLo - hi, lo - node.boundHi), real(0));
+        bound.lo = std::max(bound.lo, glm::length(gap));
+        if (bound.lo >= margin) {
+            return kOutside;
+        }
+        if (bound.hi <= -margin) {
+            return kInside;
+        }
+        uint64_t a;
+        uint64_t b;
+        switch (node.op) {
+        case SDF3Op::Translate:
+            a = TileHash(*node.a, lo - node.vector, hi - node.vector, margin);
+            break;
+        case SDF3Op::Scale:
+            TransformBounds(mat3{1 / node.scalar}, lo, hi);
+            a = TileHash(*node.a, lo, hi, margin / node.scalar);
+            break;
+        case SDF3Op::Rotate:
+            TransformBounds(node.matrix, lo, hi);
+            a = TileHash(*node.a, lo, hi, margin);
+            break;
+        case SDF3Op::Union:
+        case SDF3Op::Difference:
+        case SDF3Op::Intersection:
+            a = TileHash(*node.a, lo, hi, margin);
+            b = TileHash(*node.b, lo, hi, margin);
+            break;
+        default:
+            return m_Hashes.at(&node);
+        }
+        uint64_t hash = HashOperands(node);
+        hash = HashBytes(&a, sizeof(a), hash);
+        if (node.b) {
+            hash = HashBytes(&b, sizeof(b), hash);
+        }
+        return hash;
+    }
+
+    std::string m_Dir;
+    SDF3NodePtr m_Root;
+    uint64_t m_Settings;
+    std::unordered_map<const SDF3Node *, uint64_t> m_Hashes;
+    std::unordered_map<const SDF3Node *, std::unique_ptr<const Tape>> m_Tapes;
+    mutable std::mutex m_Mutex;
+    std::unordered_set<uint64_t> m_Used;
+    std::atomic<int> m_Hits{0};
+    std::atomic<int> m_Misses{0};
+};
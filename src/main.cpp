@@ -1,12 +1,176 @@
 #include "sdf.h"
 
+// meshes the grid in both precisions and reports throughput and how far
+// the mixed-precision vertices move relative to double precision
+void ReportPrecision(const Tape &tape, const TileGrid &grid, const int numWorkers) {
+    const ivec3 size = grid.hi - grid.lo;
+    const double numCells = double(size.x) * size.y * size.z;
+
+    std::vector<IndexedTriangles> meshes;
+    for (const Precision precision : {Precision::Double, Precision::Mixed}) {
+        std::vector<IndexedTriangles> parts(numWorkers, IndexedTriangles(grid.lo, grid.hi));
+        const auto start = std::chrono::steady_clock::now();
+        RunTiles(grid.NumTiles(), [&](const int tile, const int wi) {
+            ivec3 a, b;
+            grid.Tile(tile, a, b);
+            MeshOctree(tape, a, b, parts[wi], precision);
+        }, numWorkers);
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        meshes.push_back(WeldIndexed(parts));
+        fprintf(stderr, "  %-6s  %.3fs  %.1f Mcells/s  %zu triangles\n",
+            precision == Precision::Double ? "double" : "mixed",
+            elapsed.count(), numCells / elapsed.count() / 1e6,
+            meshes.back().triangles.size());
+    }
+
+    // welded keys are sorted, so matching vertices can be merged in one pass
+    const IndexedTriangles &a = meshes[0];
+    const IndexedTriangles &b = meshes[1];
+    real maxError = 0;
+    int unmatched = 0;
+    int i = 0;
+    int j = 0;
+    while (i < a.keys.size() || j < b.keys.size()) {
+        if (j == b.keys.size() || (i < a.keys.size() && a.keys[i] < b.keys[j])) {
+            unmatched++;
+            i++;
+        } else if (i == a.keys.size() || b.keys[j] < a.keys[i]) {
+            unmatched++;
+            j++;
+        } else {
+            maxError = std::max(maxError, glm::distance(a.vertices[i], b.vertices[j]));
+            i++;
+            j++;
+        }
+    }
+    fprintf(stderr, "  max vertex error %g, %d unmatched vertices\n",
+        double(maxError), unmatched);
+}
+
+const char *kUsage =
+    "usage: sdf [--indexed] [--output path] [--vertex-colors] [--dual] [--mixed]\n"
+    "           [--precision-report] [--cache dir] [--decimate fraction]\n"
+    "           [--decimate-error distance] [--pack-normals] [--progressive step]\n"
+    "           [--incremental dir] input.stl\n"
+    "  --indexed           weld vertices and write an indexed out.ply\n"
+    "                      instead of out.stl\n"
+    "  --output path       write to path, as .stl, .ply or .obj by its\n"
+    "                      extension; anything but .stl implies --indexed\n"
+    "  --vertex-colors     color vertices rather than faces where the\n"
+    "                      format allows\n"
+    "  --dual              extract with dual contouring instead of marching cubes\n"
+    "  --mixed             sample in float, refining near the surface in double\n"
+    "  --precision-report  compare double and mixed precision, then exit\n"
+    "  --cache dir         keep narrow-band distances of the input in dir\n"
+    "  --decimate f        decimate each tile of out.stl down to fraction f\n"
+    "                      of its triangles\n"
+    "  --decimate-error e  decimate each tile of out.stl as far as a\n"
+    "                      quadric error of e (in lattice units) allows\n"
+    "  --pack-normals      keep the input's normals in 4 bytes instead of 12\n"
+    "  --progressive s     mesh at lattice step s first, then at each half\n"
+    "                      step down to 1, writing every level as it is\n"
+    "                      done (out.8.stl, out.4.stl, ..., out.stl); marching\n"
+    "                      cubes in double precision only\n"
+    "  --incremental dir   keep each tile of out.stl in dir and re-mesh only\n"
+    "                      the tiles whose part of the model changed since\n"
+    "                      the last run with the same dir\n";
+
 int main(int argc, char **argv) {
+    std::string inputPath;
+    std::string cacheDir;
+    std::string outputPath;
+    std::string incrementalDir;
+    ColorMode colorMode = ColorMode::PerFace;
+    bool indexed = false;
+    bool report = false;
+    bool decimate = false;
+    bool packNormals = false;
+    int progressiveStep = 0;
+    DecimateOptions decimateOptions;
+    Precision precision = Precision::Double;
+    Extractor extractor = Extractor::MarchingCubes;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--indexed") {
+            indexed = true;
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (arg == "--vertex-colors") {
+            colorMode = ColorMode::PerVertex;
+        } else if (arg == "--dual") {
+            extractor = Extractor::DualContouring;
+        } else if (arg == "--mixed") {
+            precision = Precision::Mixed;
+        } else if (arg == "--precision-report") {
+            report = true;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (arg == "--decimate" && i + 1 < argc) {
+            decimate = true;
+            decimateOptions.ratio = std::stod(argv[++i]);
+        } else if (arg == "--decimate-error" && i + 1 < argc) {
+            decimate = true;
+            decimateOptions.maxError = std::stod(argv[++i]);
+        } else if (arg == "--pack-normals") {
+            packNormals = true;
+        } else if (arg == "--progressive" && i + 1 < argc) {
+            progressiveStep = std::stoi(argv[++i]);
+        } else if (arg == "--incremental" && i + 1 < argc) {
+            incrementalDir = argv[++i];
+        } else if (arg.rfind("--", 0) != 0 && inputPath.empty()) {
+            inputPath = arg;
+        } else {
+            fprintf(stderr, "unknown or incomplete argument: %s\n%s", arg.c_str(), kUsage);
+            return 1;
+        }
+    }
+    if (inputPath.empty()) {
+        fprintf(stderr, "%s", kUsage);
+        return 1;
+    }
+
+    if (outputPath.empty()) {
+        outputPath = indexed ? "out.ply" : "out.stl";
+    }
+    const std::unique_ptr<MeshWriter> meshWriter = MeshWriterFor(outputPath);
+    if (!meshWriter) {
+        fprintf(stderr, "unknown output format: %s\n", outputPath.c_str());
+        return 1;
+    }
+    // STL is streamed tile by tile, other formats need the welded mesh
+    if (!dynamic_cast<const STLMeshWriter *>(meshWriter.get())) {
+        indexed = true;
+    }
+
+    if (progressiveStep > 0) {
+        if ((progressiveStep & (progressiveStep - 1)) != 0 || progressiveStep > kProgressiveBlock) {
+            fprintf(stderr, "--progressive takes a power of two up to %d\n", kProgressiveBlock);
+            return 1;
+        }
+        // levels are marched in double precision and written whole
+        if (extractor != Extractor::MarchingCubes || precision != Precision::Double ||
+            decimate || !incrementalDir.empty())
+        {
+            fprintf(stderr, "--progressive cannot be combined with --dual, --mixed, "
+                "--decimate, --decimate-error or --incremental\n");
+            return 1;
+        }
+    } else if (indexed && (decimate || !incrementalDir.empty())) {
+        // decimation and the tile cache work on the streamed STL tiles
+        fprintf(stderr, "--decimate, --decimate-error and --incremental need STL output "
+            "without --indexed\n");
+        return 1;
+    }
+
     RTCDevice device = rtcNewDevice(NULL);
 
+    // Mesh reports its own loading phases
+    const SDF3 mesh = Mesh(device, inputPath, cacheDir, packNormals);
+
     auto done = timed("initializing");
 
     // const real r = 500;
-    // const int hx = r + 1, hy = r + 1, hz = r + 1;
 
     // SDF3 f = Sphere(r).Color({0, 0, 0});
     // f &= Box(vec3(r * 0.75)).Color({1, 1, 1});
@@ -15,90 +179,146 @@ int main(int argc, char **argv) {
     // f -= Rotate(Cylinder(r / 2).Color({0, 0, 1}), M_PI / 2, Z);
     // f &= Plane(Z).Color({1, 0, 1});
 
-    const int hx = 16 * 20;
-    const int hy = 16 * 20;
-    const int hz = 26 * 20;
-
-    SDF3 f = Mesh(device, argv[1]).Color(0x3498DB);
+    SDF3 f = SDF3(mesh).Color(0x3498DB);
     f &= Rotate(Plane(Y).Color(0xE74C3C), M_PI / 8, X);
 
+    const Tape tape(f);
+
     done();
 
-    std::vector<vec3> points;
-    std::vector<vec3> colors;
-    std::mutex mutex;
+    // the lattice covers the root's bounding box, with a cell of margin so
+    // the surface closes inside it
+    const SDF3Node &root = *f.GetNode();
+    for (int i = 0; i < 3; i++) {
+        if (std::isinf(root.boundLo[i]) || std::isinf(root.boundHi[i])) {
+            fprintf(stderr, "the model is unbounded, cannot place the lattice\n");
+            return 1;
+        }
+    }
+    const int tileSize = 32;
+    ivec3 lo = ivec3(glm::floor(root.boundLo)) - 1;
+    ivec3 hi = ivec3(glm::ceil(root.boundHi)) + 1;
+    // incremental tiles are keyed by their boxes, so they sit on a fixed grid
+    // that an edit moving the model's bounds does not shift
+    if (!incrementalDir.empty()) {
+        lo = ivec3(glm::floor(vec3(lo) / real(tileSize))) * tileSize;
+        hi = ivec3(glm::ceil(vec3(hi) / real(tileSize))) * tileSize;
+    }
+
+    const int numWorkers = std::thread::hardware_concurrency();
+    const TileGrid grid(lo, hi, tileSize);
 
-    const auto worker = [&](const int wi, const int wn) {
+    // meshes one tile into the given worker output
+    const auto meshTile = [&](const int tile, auto &out) {
         _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
         _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
-        std::vector<vec3> workerPoints;
-        std::vector<vec3> workerColors;
-        const real kHalfDiag = 0.8660254037844386;
-        for (int x0 = -hx + wi; x0 < hx; x0 += wn) {
-            const int x1 = x0 + 1;
-            for (int y0 = -hy; y0 < hy; y0++) {
-                const int y1 = y0 + 1;
-                real best = 1e9;
-                for (int z0 = -hz; z0 < hz; z0++) {
-                    const int z1 = z0 + 1;
-
-                    const vec3 mid(x0 + 0.5, y0 + 0.5, z0 + 0.5);
-                    const real d = std::abs(f(mid));
-                    best = std::min(best, d);
-                    if (d > kHalfDiag) {
-                        z0 += std::floor(d - kHalfDiag);
-                        continue;
-                    }
-
-                    const std::array<vec3, 8> p = {{
-                        {x0, y0, z0},
-                        {x1, y0, z0},
-                        {x1, y1, z0},
-                        {x0, y1, z0},
-                        {x0, y0, z1},
-                        {x1, y0, z1},
-                        {x1, y1, z1},
-                        {x0, y1, z1},
-                    }};
-
-                    const std::array<real, 8> v = {{
-                        f(p[0]),
-                        f(p[1]),
-                        f(p[2]),
-                        f(p[3]),
-                        f(p[4]),
-                        f(p[5]),
-                        f(p[6]),
-                        f(p[7]),
-                    }};
-
-                    const int numTriangles = MarchingCubes(p, v, 0, workerPoints);
-
-                    if (numTriangles > 0) {
-                        const vec3 color = f.GetColor(mid);
-                        for (int i = 0; i < numTriangles; i++) {
-                            workerColors.push_back(color);
-                        }
-                    }
-                }
+        ivec3 a, b;
+        grid.Tile(tile, a, b);
+        MeshOctree(tape, a, b, out, precision, extractor);
+    };
+
+    if (report) {
+        ReportPrecision(tape, grid, numWorkers);
+        return 0;
+    }
 
-                // if (best > kHalfDiag) {
-                //     y0 += std::floor(best - kHalfDiag);
-                // }
+    if (progressiveStep > 0) {
+        const std::filesystem::path path(outputPath);
+        done = timed("running workers");
+        MeshProgressive(tape, lo, hi, progressiveStep, [&](const int step, std::vector<TriangleSoup> &parts) {
+            TriangleSoup soup;
+            for (const TriangleSoup &part : parts) {
+                soup.points.insert(soup.points.end(), part.points.begin(), part.points.end());
+                soup.colors.insert(soup.colors.end(), part.colors.begin(), part.colors.end());
             }
-        }
-        std::lock_guard<std::mutex> guard(mutex);
-        points.insert(points.end(), workerPoints.begin(), workerPoints.end());
-        colors.insert(colors.end(), workerColors.begin(), workerColors.end());
-    };
+            std::filesystem::path levelPath = path;
+            if (step > 1) {
+                levelPath.replace_extension("." + std::to_string(step) + path.extension().string());
+            }
+            meshWriter->SaveSoup(levelPath.string(), soup.points, soup.colors, colorMode);
+            fprintf(stderr, "  step %d: %zu triangles to %s\n",
+                step, soup.colors.size(), levelPath.string().c_str());
+        }, numWorkers);
+        done();
+        return 0;
+    }
+
+    if (indexed) {
+        std::vector<IndexedTriangles> parts(numWorkers, IndexedTriangles(lo, hi));
+
+        done = timed("running workers");
+        const auto stats = RunTiles(grid.NumTiles(), [&](const int tile, const int wi) {
+            meshTile(tile, parts[wi]);
+        }, numWorkers);
+        done();
+        PrintWorkerStats(stats);
+
+        done = timed("welding vertices");
+        const IndexedTriangles mesh = WeldIndexed(parts);
+        done();
+
+        done = timed("writing output");
+        meshWriter->Save(outputPath, mesh.vertices, mesh.triangles, mesh.colors, colorMode);
+        done();
+
+        return 0;
+    }
+
+    // Tiles are meshed one z slab at a time and each worker streams its
+    // tile's triangles straight into the output file. Flushing between slabs
+    // keeps peak memory set by the slab size rather than the output size.
+    STLWriter writer(outputPath);
+    std::vector<TriangleSoup> soups(numWorkers);
+
+    std::unique_ptr<TileCache> cache;
+    if (!incrementalDir.empty()) {
+        uint64_t settings = HashBytes(&precision, sizeof(precision));
+        settings = HashBytes(&extractor, sizeof(extractor), settings);
+        cache = std::make_unique<TileCache>(incrementalDir, f, settings);
+    }
+    std::vector<WorkerStats> stats(numWorkers);
 
     done = timed("running workers");
-    RunWorkers(worker);
+    for (int slab = 0; slab < grid.NumSlabs(); slab++) {
+        const int first = slab * grid.SlabTiles();
+        const auto slabStats = RunTiles(grid.SlabTiles(), [&](const int tile, const int wi) {
+            TriangleSoup &soup = soups[wi];
+            if (cache) {
+                ivec3 a, b;
+                grid.Tile(first + tile, a, b);
+                const uint64_t key = cache->Key(a, b);
+                if (!cache->Load(key, soup)) {
+                    meshTile(first + tile, soup);
+                    cache->Save(key, soup);
+                }
+            } else {
+                meshTile(first + tile, soup);
+            }
+            if (decimate) {
+                Decimate(soup, decimateOptions);
+            }
+            writer.Write(soup.points, soup.colors);
+            soup.points.clear();
+            soup.colors.clear();
+        }, numWorkers);
+        writer.Flush();
+        for (int i = 0; i < numWorkers; i++) {
+            stats[i].tiles += slabStats[i].tiles;
+            stats[i].stolen += slabStats[i].stolen;
+            stats[i].busy += slabStats[i].busy;
+            stats[i].wall += slabStats[i].wall;
+        }
+    }
     done();
+    PrintWorkerStats(stats);
+    if (cache) {
+        cache->Prune();
+        fprintf(stderr, "  %d tiles reused, %d meshed\n", cache->NumHits(), cache->NumMisses());
+    }
 
     done = timed("writing output");
-    SaveBinarySTL("out.stl", points, colors);
+    writer.Close();
     done();
 
     return 0;
@@ -300,11 +300,14 @@ const std::array<std::vector<int>, 256> triangleTable = {{
     {},
 }};
 
-int MarchingCubes(
+// Computes the interpolated point on every cell edge the surface crosses
+// and returns the cell's triangles as a list of edge indices (0-11), three
+// per triangle.
+const std::vector<int> &MarchingCubesEdges(
     const std::array<vec3, 8> &p,
     const std::array<real, 8> &v,
     const real x,
-    std::vector<vec3> &out)
+    std::array<vec3, 12> &points)
 {
     int mask = 0;
     for (int i = 0; i < 8; i++) {
@@ -313,20 +316,62 @@ int MarchingCubes(
         }
     }
     if (edgeTable[mask] == 0) {
-        return 0;
+        return triangleTable[0];
     }
-    std::array<vec3, 12> points;
     for (int i = 0; i < 12; i++) {
         const int bit = 1 << i;
         if (edgeTable[mask] & bit) {
-            const int a = pairTable[i][0];
-            const int b = pairTable[i][1];
+            // interpolate from the lower value so every cell sharing an
+            // edge computes a bit-identical point
+            int a = pairTable[i][0];
+            int b = pairTable[i][1];
+            if (v[b] < v[a]) {
+                std::swap(a, b);
+            }
             const real t = (x - v[a]) / (v[b] - v[a]);
             points[i] = p[a] + (p[b] - p[a]) * t;
         }
     }
-    for (const int i : triangleTable[mask]) {
+    return triangleTable[mask];
+}
+
+int MarchingCubes(
+    const std::array<vec3, 8> &p,
+    const std::array<real, 8> &v,
+    const real x,
+    std::vector<vec3> &out)
+{
+    std::array<vec3, 12> points;
+    const std::vector<int> &edges = MarchingCubesEdges(p, v, x, points);
+    for (const int i : edges) {
         out.push_back(points[i]);
     }
-    return triangleTable[mask].size() / 3;
+    return edges.size() / 3;
+}
+
+// Dual contouring places one vertex per cell: the point that best fits the
+// tangent planes (point, normal) at the cell's edge crossings, found as a
+// least-squares solve around their mass point. Regularization pulls
+// directions the planes leave free (flat or single-edge cells) back toward
+// the mass point, and the result is clamped to the cell.
+const real kDualRegularization = 0.05;
+
+vec3 DualContouringVertex(
+    const vec3 *points, const vec3 *normals, const int n,
+    const vec3 &lo, const vec3 &hi)
+{
+    vec3 mass{0};
+    for (int i = 0; i < n; i++) {
+        mass += points[i];
+    }
+    mass /= real(n);
+
+    mat3 ata{kDualRegularization};
+    vec3 atb{0};
+    for (int i = 0; i < n; i++) {
+        const vec3 &normal = normals[i];
+        ata = ata + glm::outerProduct(normal, normal);
+        atb += normal * glm::dot(normal, points[i] - mass);
+    }
+    return glm::clamp(mass + glm::inverse(ata) * atb, lo, hi);
 }
@@ -0,0 +1,766 @@
+#pragma once
+
+// Mesh extraction drivers. Each driver covers the lattice cells in [lo, hi),
+// typically one tile of a TileGrid, and hands each sampled cell to an
+// Output (TriangleSoup or IndexedTriangles below).
+
+const real kHalfDiag = 0.8660254037844386;
+
+// Double samples every lattice point in double precision. Mixed samples in
+// float (twice the SIMD lanes) and re-samples in double only the points
+// close enough to the surface to be a corner of a cell it crosses, which
+// are the only values marching cubes interpolates.
+enum class Precision {
+    Double,
+    Mixed,
+};
+
+// corners of a cell crossed by a 1-Lipschitz surface are within one cell
+// diagonal of it; the margin covers float rounding of the coarse pass
+const real kRefineBand = 2 * kHalfDiag + 0.01;
+
+// MarchingCubes emits up to 5 triangles per cell with vertices on lattice
+// edges. DualContouring emits one vertex per cell and one quad per crossed
+// lattice edge, placing vertices with SDF gradients so sharp CSG edges and
+// corners survive at coarse spacing.
+enum class Extractor {
+    MarchingCubes,
+    DualContouring,
+};
+
+// false position steps taken to place each dual contouring edge crossing
+const int kCrossingIterations = 4;
+
+// cuts the lattice cells [lo, hi) into tiles of up to size^3 cells,
+// numbered with x varying fastest, so each z slab of tiles is a contiguous
+// range of tile indices
+struct TileGrid {
+    TileGrid(const ivec3 &lo, const ivec3 &hi, const int size) :
+        lo(lo), hi(hi), size(size), count((hi - lo + size - 1) / size) {}
+
+    int NumTiles() const {
+        return count.x * count.y * count.z;
+    }
+
+    int NumSlabs() const {
+        return count.z;
+    }
+
+    int SlabTiles() const {
+        return count.x * count.y;
+    }
+
+    void Tile(const int i, ivec3 &a, ivec3 &b) const {
+        const ivec3 index(i % count.x, (i / count.x) % count.y, i / (count.x * count.y));
+        a = lo + index * size;
+        b = glm::min(a + size, hi);
+    }
+
+    ivec3 lo;
+    ivec3 hi;
+    int size;
+    ivec3 count;
+};
+
+bool BoundExcludesSurface(const Tape &tape, const vec3 &lo, const vec3 &hi) {
+    const Interval bound = tape.Bound(lo, hi);
+    return bound.lo > 0 || bound.hi < 0;
+}
+
+// corner offsets in the order MarchingCubes expects
+const std::array<ivec3, 8> kCellCorners = {{
+    {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+    {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1},
+}};
+
+// Triangles as a flat list of points, three per triangle, with one color per
+// triangle.
+struct TriangleSoup {
+    void AddCell(
+        const ivec3 &cell,
+        const std::array<vec3, 8> &p, const std::array<real, 8> &v,
+        const vec3 &color)
+    {
+        const int numTriangles = MarchingCubes(p, v, 0, points);
+        for (int i = 0; i < numTriangles; i++) {
+            colors.push_back(color);
+        }
+        PROFILE_COUNT(Triangles, numTriangles);
+    }
+
+    // cells are ordered around the crossed lattice edge, facing outward
+    void AddQuad(
+        const std::array<ivec3, 4> &cells, const std::array<vec3, 4> &p,
+        const vec3 &color)
+    {
+        points.insert(points.end(), {p[0], p[1], p[2], p[0], p[2], p[3]});
+        colors.insert(colors.end(), {color, color});
+        PROFILE_COUNT(Triangles, 2);
+    }
+
+    std::vector<vec3> points;
+    std::vector<vec3> colors;
+};
+
+// Triangles indexing into a shared vertex buffer. Each vertex is keyed by
+// the lattice edge it was interpolated on; a worker welds its own vertices
+// with a local map and WeldIndexed merges workers by sorting keys.
+struct IndexedTriangles {
+    IndexedTriangles(const ivec3 &lo, const ivec3 &hi) :
+        lo(lo), size(hi - lo + 1) {}
+
+    // lattice point (relative to lo) and axis of the edge's lower end
+    uint64_t EdgeKey(const ivec3 &cell, const int edge) const {
+        const ivec3 &a = kCellCorners[pairTable[edge][0]];
+        const ivec3 &b = kCellCorners[pairTable[edge][1]];
+        const ivec3 p = cell - lo + glm::min(a, b);
+        const int axis = a.x != b.x ? 0 : a.y != b.y ? 1 : 2;
+        return ((uint64_t(p.x) * size.y + p.y) * size.z + p.z) * 3 + axis;
+    }
+
+    void AddCell(
+        const ivec3 &cell,
+        const std::array<vec3, 8> &p, const std::array<real, 8> &v,
+        const vec3 &color)
+    {
+        std::array<vec3, 12> edgePoints;
+        const std::vector<int> &edges = MarchingCubesEdges(p, v, 0, edgePoints);
+        if (edges.empty()) {
+            return;
+        }
+        std::array<int, 12> indices;
+        for (int i = 0; i < edges.size(); i++) {
+            const int edge = edges[i];
+            const uint64_t key = EdgeKey(cell, edge);
+            const auto it = lookup.find(key);
+            if (it != lookup.end()) {
+                indices[i] = it->second;
+            } else {
+                indices[i] = vertices.size();
+                lookup[key] = vertices.size();
+                keys.push_back(key);
+                vertices.push_back(edgePoints[edge]);
+            }
+        }
+        for (int i = 0; i < edges.size(); i += 3) {
+            triangles.emplace_back(indices[i], indices[i + 1], indices[i + 2]);
+            colors.push_back(color);
+        }
+        PROFILE_COUNT(Triangles, edges.size() / 3);
+    }
+
+    // dual vertices are keyed by cell; cells start one before lo
+    uint64_t CellKey(const ivec3 &cell) const {
+        const ivec3 p = cell - lo + 1;
+        return (uint64_t(p.x) * size.y + p.y) * size.z + p.z;
+    }
+
+    void AddQuad(
+        const std::array<ivec3, 4> &cells, const std::array<vec3, 4> &p,
+        const vec3 &color)
+    {
+        std::array<int, 4> indices;
+        for (int i = 0; i < 4; i++) {
+            const uint64_t key = CellKey(cells[i]);
+            const auto it = lookup.find(key);
+            if (it != lookup.end()) {
+                indices[i] = it->second;
+            } else {
+                indices[i] = vertices.size();
+                lookup[key] = vertices.size();
+                keys.push_back(key);
+                vertices.push_back(p[i]);
+            }
+        }
+        triangles.emplace_back(indices[0], indices[1], indices[2]);
+        triangles.emplace_back(indices[0], indices[2], indices[3]);
+        colors.insert(colors.end(), {color, color});
+        PROFILE_COUNT(Triangles, 2);
+    }
+
+    ivec3 lo;
+    ivec3 size;
+    std::unordered_map<uint64_t, int> lookup;
+    std::vector<uint64_t> keys;
+    std::vector<vec3> vertices;
+    std::vector<ivec3> triangles;
+    std::vector<vec3> colors;
+};
+
+// merges per-worker indexed meshes into one, welding vertices that share a
+// lattice edge key. Keys are sorted rather than hashed.
+IndexedTriangles WeldIndexed(std::vector<IndexedTriangles> &parts) {
+    IndexedTriangles result(parts.front().lo, parts.front().lo + parts.front().size - 1);
+
+    // global provisional index = part offset + local index
+    std::vector<int> offsets;
+    std::vector<std::pair<uint64_t, int>> order;
+    for (const IndexedTriangles &part : parts) {
+        offsets.push_back(order.size());
+        for (int i = 0; i < part.keys.size(); i++) {
+            order.emplace_back(part.keys[i], order.size());
+        }
+    }
+    boost::sort::block_indirect_sort(order.begin(), order.end());
+
+    std::vector<int> remap(order.size());
+    std::vector<const vec3 *> positions(order.size());
+    for (int i = 0; i < parts.size(); i++) {
+        for (int j = 0; j < parts[i].vertices.size(); j++) {
+            positions[offsets[i] + j] = &parts[i].vertices[j];
+        }
+    }
+    for (int i = 0; i < order.size(); i++) {
+        if (i == 0 || order[i].first != order[i - 1].first) {
+            result.keys.push_back(order[i].first);
+            result.vertices.push_back(*positions[order[i].second]);
+        }
+        remap[order[i].second] = result.vertices.size() - 1;
+    }
+
+    for (int i = 0; i < parts.size(); i++) {
+        IndexedTriangles &part = parts[i];
+        const int offset = offsets[i];
+        for (const ivec3 &t : part.triangles) {
+            result.triangles.emplace_back(
+                remap[offset + t.x], remap[offset + t.y], remap[offset + t.z]);
+        }
+        result.colors.insert(result.colors.end(), part.colors.begin(), part.colors.end());
+        part = IndexedTriangles(part.lo, part.lo + part.size - 1);
+    }
+    return result;
+}
+
+// samples points in one batch, see Precision
+void SamplePoints(
+    const Tape &tape, const std::vector<vec3> &points,
+    const Precision precision,
+    std::vector<real> &values, std::vector<int> &materials)
+{
+    values.resize(points.size());
+    materials.resize(points.size());
+    if (precision == Precision::Mixed) {
+        std::vector<float> coarse(points.size());
+        tape.Evaluate(points.data(), coarse.data(), points.size(), materials.data());
+
+        std::vector<vec3> near;
+        std::vector<int> nearIndex;
+        for (int i = 0; i < points.size(); i++) {
+            values[i] = coarse[i];
+            if (std::abs(coarse[i]) < kRefineBand) {
+                near.push_back(points[i]);
+                nearIndex.push_back(i);
+            }
+        }
+
+        std::vector<real> refined(near.size());
+        std::vector<int> refinedMaterials(near.size());
+        tape.Evaluate(near.data(), refined.data(), near.size(), refinedMaterials.data());
+        for (int j = 0; j < near.size(); j++) {
+            values[nearIndex[j]] = refined[j];
+            materials[nearIndex[j]] = refinedMaterials[j];
+        }
+    } else {
+        tape.Evaluate(points.data(), values.data(), points.size(), materials.data());
+    }
+}
+
+// Lattice values over the points [lo, hi] of one MeshOctree call, sampled
+// lazily (NaN = not sampled yet). Every leaf samples through it, so a
+// corner shared by neighboring leaves is sampled once. Nothing is allocated
+// before the first leaf, as most calls are culled whole.
+class LatticeCache {
+public:
+    LatticeCache(const ivec3 &lo, const ivec3 &hi) :
+        m_Lo(lo), m_Size(hi - lo + 1) {}
+
+    // samples the points of [lo, hi] that are not sampled yet
+    void Sample(const Tape &tape, const ivec3 &lo, const ivec3 &hi, const Precision precision) {
+        if (m_Values.empty()) {
+            const size_t n = size_t(m_Size.x) * m_Size.y * m_Size.z;
+            m_Values.assign(n, kUnset);
+            m_Materials.assign(n, 0);
+        }
+        std::vector<vec3> points;
+        std::vector<size_t> indices;
+        for (int z = lo.z; z <= hi.z; z++) {
+            for (int y = lo.y; y <= hi.y; y++) {
+                for (int x = lo.x; x <= hi.x; x++) {
+                    const size_t i = Index(ivec3(x, y, z));
+                    if (std::isnan(m_Values[i])) {
+                        points.emplace_back(x, y, z);
+                        indices.push_back(i);
+                    }
+                }
+            }
+        }
+        if (points.empty()) {
+            return;
+        }
+        std::vector<real> values;
+        std::vector<int> materials;
+        SamplePoints(tape, points, precision, values, materials);
+        for (int j = 0; j < indices.size(); j++) {
+            m_Values[indices[j]] = values[j];
+            m_Materials[indices[j]] = materials[j];
+        }
+    }
+
+    real Value(const ivec3 &p) const {
+        return m_Values[Index(p)];
+    }
+
+    int Material(const ivec3 &p) const {
+        return m_Materials[Index(p)];
+    }
+
+private:
+    static constexpr real kUnset = std::numeric_limits<real>::quiet_NaN();
+
+    size_t Index(const ivec3 &p) const {
+        const ivec3 q = p - m_Lo;
+        return (size_t(q.z) * m_Size.y + q.y) * m_Size.x + q.x;
+    }
+
+    ivec3 m_Lo;
+    ivec3 m_Size;
+    std::vector<real> m_Values;
+    std::vector<int> m_Materials;
+};
+
+// samples the lattice of a block (what lattice does not hold yet) in one
+// batch and marches its cells
+template <typename Output>
+void MeshBlock(
+    const Tape &tape,
+    const ivec3 &lo, const ivec3 &hi,
+    LatticeCache &lattice,
+    Output &out,
+    const Precision precision = Precision::Double)
+{
+    lattice.Sample(tape, lo, hi, precision);
+    PROFILE_COUNT(CellsVisited, (hi.x - lo.x) * (hi.y - lo.y) * (hi.z - lo.z));
+
+    for (int z0 = lo.z; z0 < hi.z; z0++) {
+        const int z1 = z0 + 1;
+        for (int y0 = lo.y; y0 < hi.y; y0++) {
+            const int y1 = y0 + 1;
+            for (int x0 = lo.x; x0 < hi.x; x0++) {
+                const int x1 = x0 + 1;
+
+                const std::array<real, 8> v = {{
+                    lattice.Value({x0, y0, z0}),
+                    lattice.Value({x1, y0, z0}),
+                    lattice.Value({x1, y1, z0}),
+                    lattice.Value({x0, y1, z0}),
+                    lattice.Value({x0, y0, z1}),
+                    lattice.Value({x1, y0, z1}),
+                    lattice.Value({x1, y1, z1}),
+                    lattice.Value({x0, y1, z1}),
+                }};
+
+                const std::array<vec3, 8> p = {{
+                    {x0, y0, z0},
+                    {x1, y0, z0},
+                    {x1, y1, z0},
+                    {x0, y1, z0},
+                    {x0, y0, z1},
+                    {x1, y0, z1},
+                    {x1, y1, z1},
+                    {x0, y1, z1},
+                }};
+
+                // color the cell by its corner closest to the surface
+                int nearest = 0;
+                for (int i = 1; i < 8; i++) {
+                    if (std::abs(v[i]) < std::abs(v[nearest])) {
+                        nearest = i;
+                    }
+                }
+                const int material = lattice.Material(ivec3(x0, y0, z0) + kCellCorners[nearest]);
+
+                out.AddCell(ivec3(x0, y0, z0), p, v, tape.MaterialColor(material));
+            }
+        }
+    }
+}
+
+// Dual contouring over the lattice edges starting in [lo, hi). Cells one
+// step below lo are sampled too, so each edge sees all four cells around it;
+// a cell shared with a neighboring box gets the same vertex in both.
+template <typename Output>
+void MeshDual(
+    const Tape &tape,
+    const ivec3 &lo, const ivec3 &hi,
+    LatticeCache &lattice,
+    Output &out,
+    const Precision precision = Precision::Double)
+{
+    const ivec3 a = lo - 1;
+    const ivec3 size = hi - a + 1;
+    lattice.Sample(tape, a, hi, precision);
+    PROFILE_COUNT(CellsVisited, (hi.x - lo.x) * (hi.y - lo.y) * (hi.z - lo.z));
+
+    const auto index = [&](const ivec3 &p) {
+        return ((p.z - a.z) * size.y + (p.y - a.y)) * size.x + (p.x - a.x);
+    };
+
+    // crossing point of every lattice edge with a sign change
+    std::vector<int> crossingOf(size.x * size.y * size.z * 3, -1);
+    std::vector<vec3> crossings;
+    std::vector<vec3> ends;
+    std::vector<std::array<real, 2>> endValues;
+    for (int z = a.z; z <= hi.z; z++) {
+        for (int y = a.y; y <= hi.y; y++) {
+            for (int x = a.x; x <= hi.x; x++) {
+                const ivec3 p(x, y, z);
+                for (int axis = 0; axis < 3; axis++) {
+                    ivec3 q = p;
+                    q[axis]++;
+                    if (q[axis] > hi[axis]) {
+                        continue;
+                    }
+                    const real v0 = lattice.Value(p);
+                    const real v1 = lattice.Value(q);
+                    if ((v0 < 0) == (v1 < 0)) {
+                        continue;
+                    }
+                    crossingOf[index(p) * 3 + axis] = crossings.size();
+                    crossings.push_back(vec3(p));
+                    ends.push_back(vec3(q));
+                    endValues.push_back({v0, v1});
+                }
+            }
+        }
+    }
+    if (crossings.empty()) {
+        return;
+    }
+
+    // The distance is not linear along an edge near sharp features, so the
+    // interpolated crossing is refined by a few batched Illinois
+    // (false position) steps; crossings[i] and ends[i] bracket the root.
+    std::vector<vec3> estimates(crossings.size());
+    std::vector<real> estimateValues(crossings.size());
+    std::vector<int8_t> lastSide(crossings.size(), -1);
+    for (int iteration = 0; iteration <= kCrossingIterations; iteration++) {
+        for (int i = 0; i < crossings.size(); i++) {
+            const auto &v = endValues[i];
+            estimates[i] = glm::mix(crossings[i], ends[i], v[0] / (v[0] - v[1]));
+        }
+        if (iteration == kCrossingIterations) {
+            break;
+        }
+        tape.Evaluate(estimates.data(), estimateValues.data(), estimates.size());
+        for (int i = 0; i < crossings.size(); i++) {
+            auto &v = endValues[i];
+            if (estimateValues[i] == 0) {
+                crossings[i] = ends[i] = estimates[i];
+                v = {-1, 1};
+                continue;
+            }
+            const int side = (estimateValues[i] < 0) == (v[0] < 0) ? 0 : 1;
+            if (side == 0) {
+                crossings[i] = estimates[i];
+            } else {
+                ends[i] = estimates[i];
+            }
+            v[side] = estimateValues[i];
+            if (side == lastSide[i]) {
+                v[1 - side] *= real(0.5);
+            }
+            lastSide[i] = side;
+        }
+    }
+    crossings = estimates;
+
+    // surface normals at the crossings, from a tetrahedral central difference
+    const real h = 1e-3;
+    const std::array<vec3, 4> tetra = {{
+        {1, -1, -1}, {-1, -1, 1}, {-1, 1, -1}, {1, 1, 1},
+    }};
+    std::vector<vec3> samples;
+    samples.reserve(crossings.size() * 4);
+    for (const vec3 &c : crossings) {
+        for (const vec3 &k : tetra) {
+            samples.push_back(c + k * h);
+        }
+    }
+    std::vector<real> d(samples.size());
+    tape.Evaluate(samples.data(), d.data(), samples.size());
+    std::vector<vec3> normals(crossings.size());
+    for (int i = 0; i < crossings.size(); i++) {
+        vec3 g{0};
+        for (int k = 0; k < 4; k++) {
+            g += tetra[k] * d[i * 4 + k];
+        }
+        const real length = glm::length(g);
+        normals[i] = length > 0 ? g / length : vec3{0};
+    }
+
+    // one vertex per cell in [a, hi) with any crossing
+    const ivec3 cells = hi - a;
+    const auto cellIndex = [&](const ivec3 &c) {
+        return ((c.z - a.z) * cells.y + (c.y - a.y)) * cells.x + (c.x - a.x);
+    };
+    std::vector<vec3> cellVertices(cells.x * cells.y * cells.z);
+    for (int z = a.z; z < hi.z; z++) {
+        for (int y = a.y; y < hi.y; y++) {
+            for (int x = a.x; x < hi.x; x++) {
+                const ivec3 cell(x, y, z);
+                std::array<vec3, 12> points;
+                std::array<vec3, 12> pointNormals;
+                int n = 0;
+                for (const auto &pair : pairTable) {
+                    const ivec3 &c0 = kCellCorners[pair[0]];
+                    const ivec3 &c1 = kCellCorners[pair[1]];
+                    const int axis = c0.x != c1.x ? 0 : c0.y != c1.y ? 1 : 2;
+                    const int i = crossingOf[index(cell + glm::min(c0, c1)) * 3 + axis];
+                    if (i >= 0) {
+                        points[n] = crossings[i];
+                        pointNormals[n] = normals[i];
+                        n++;
+                    }
+                }
+                if (n > 0) {
+                    cellVertices[cellIndex(cell)] = DualContouringVertex(
+                        points.data(), pointNormals.data(), n,
+                        vec3(cell), vec3(cell + 1));
+                }
+            }
+        }
+    }
+
+    // a quad around every crossed edge this box owns
+    for (int z = lo.z; z < hi.z; z++) {
+        for (int y = lo.y; y < hi.y; y++) {
+            for (int x = lo.x; x < hi.x; x++) {
+                const ivec3 p(x, y, z);
+                for (int axis = 0; axis < 3; axis++) {
+                    if (crossingOf[index(p) * 3 + axis] < 0) {
+                        continue;
+                    }
+                    ivec3 q = p;
+                    q[axis]++;
+                    ivec3 u{0};
+                    ivec3 v{0};
+                    u[(axis + 1) % 3] = 1;
+                    v[(axis + 2) % 3] = 1;
+
+                    // counterclockwise around the edge axis, reversed when
+                    // the inside is at the far end
+                    std::array<ivec3, 4> quad = {{p, p - u, p - u - v, p - v}};
+                    const real v0 = lattice.Value(p);
+                    const real v1 = lattice.Value(q);
+                    if (v0 >= 0) {
+                        std::swap(quad[1], quad[3]);
+                    }
+                    std::array<vec3, 4> positions;
+                    for (int i = 0; i < 4; i++) {
+                        positions[i] = cellVertices[cellIndex(quad[i])];
+                    }
+
+                    const int material = lattice.Material(std::abs(v0) < std::abs(v1) ? p : q);
+                    out.AddQuad(quad, positions, tape.MaterialColor(material));
+                }
+            }
+        }
+    }
+}
+
+// the recursion of MeshOctree, with leaves sampling through lattice
+template <typename Output>
+void MeshOctreeBlock(
+    const Tape &tape,
+    const ivec3 &lo, const ivec3 &hi,
+    LatticeCache &lattice,
+    Output &out,
+    const Precision precision,
+    const Extractor extractor)
+{
+    const int kLeafSize = 4;
+
+    if (BoundExcludesSurface(tape, vec3(lo), vec3(hi))) {
+        PROFILE_COUNT(CellsSkippedBound, (hi.x - lo.x) * (hi.y - lo.y) * (hi.z - lo.z));
+        return;
+    }
+
+    const ivec3 size = hi - lo;
+    if (size.x <= kLeafSize && size.y <= kLeafSize && size.z <= kLeafSize) {
+        if (extractor == Extractor::DualContouring) {
+            MeshDual(tape, lo, hi, lattice, out, precision);
+        } else {
+            MeshBlock(tape, lo, hi, lattice, out, precision);
+        }
+        return;
+    }
+
+    // split every axis that is still larger than a leaf
+    const ivec3 mid = lo + size / 2;
+    for (int i = 0; i < 8; i++) {
+        ivec3 a = lo;
+        ivec3 b = hi;
+        bool valid = true;
+        for (int axis = 0; axis < 3; axis++) {
+            const bool upper = (i >> axis) & 1;
+            if (size[axis] <= kLeafSize) {
+                valid &= !upper;
+            } else if (upper) {
+                a[axis] = mid[axis];
+            } else {
+                b[axis] = mid[axis];
+            }
+        }
+        if (valid) {
+            MeshOctreeBlock(tape, a, b, lattice, out, precision, extractor);
+        }
+    }
+}
+
+// subdivides [lo, hi) top-down, discarding blocks whose distance bound
+// cannot contain the surface. For a custom (1-Lipschitz) distance the bound
+// is the value at the block center +/- the half-diagonal. The surviving
+// leaves share one LatticeCache, so each lattice point of [lo, hi] is
+// sampled at most once.
+template <typename Output>
+void MeshOctree(
+    const Tape &tape,
+    const ivec3 &lo, const ivec3 &hi,
+    Output &out,
+    const Precision precision = Precision::Double,
+    const Extractor extractor = Extractor::MarchingCubes)
+{
+    // dual contouring leaves also read the cells one step below them
+    LatticeCache lattice(extractor == Extractor::DualContouring ? lo - 1 : lo, hi);
+    MeshOctreeBlock(tape, lo, hi, lattice, out, precision, extractor);
+}
+
+// Progressive marching cubes over [lo, hi) (hi is rounded up to whole
+// coarsest cells), for a quick preview that sharpens.
+//
+// The first level marches cells of coarsestStep lattice units; each later
+// level halves the step, down to 1. A level only visits the children of the
+// previous level's cells that may hold surface: a cell of step s holds none
+// if every corner is further than s * kHalfDiag from it, as any point of the
+// cell is within that of some corner. So every level is the full marching
+// cubes mesh at its step, and the last one matches the other drivers.
+//
+// Levels are cut into blocks of kProgressiveBlock^3 lattice units, run as
+// tiles on numWorkers workers; a block whose distance bound excludes the
+// surface is dropped before the first level. levelFunc gets each level's
+// triangles, one soup per worker, as soon as the level is done.
+const int kProgressiveBlock = 64;
+
+using LevelFunc = std::function<void(int step, std::vector<TriangleSoup> &parts)>;
+
+void MeshProgressive(
+    const Tape &tape,
+    const ivec3 &lo, const ivec3 &hi,
+    const int coarsestStep,
+    const LevelFunc &levelFunc,
+    const int numWorkers = std::thread::hardware_concurrency())
+{
+    assert(coarsestStep > 0 && (coarsestStep & (coarsestStep - 1)) == 0);
+    assert(coarsestStep <= kProgressiveBlock);
+    const ivec3 size = (hi - lo + coarsestStep - 1) / coarsestStep * coarsestStep;
+    const TileGrid grid(lo, lo + size, kProgressiveBlock);
+
+    // the cells of a block that the next level refines, as flags over the
+    // block's cells at the current step (x fastest)
+    struct Block {
+        ivec3 lo;
+        ivec3 hi;
+        std::vector<uint8_t> refine;
+    };
+    std::vector<Block> blocks;
+    for (int i = 0; i < grid.NumTiles(); i++) {
+        Block block;
+        grid.Tile(i, block.lo, block.hi);
+        if (!BoundExcludesSurface(tape, vec3(block.lo), vec3(block.hi))) {
+            blocks.push_back(std::move(block));
+        }
+    }
+
+    std::vector<TriangleSoup> parts(numWorkers);
+    for (int step = coarsestStep; step >= 1; step /= 2) {
+        const bool first = step == coarsestStep;
+        const real band = step * kHalfDiag;
+        RunTiles(blocks.size(), [&](const int b, const int wi) {
+            Block &block = blocks[b];
+            const ivec3 n = (block.hi - block.lo) / step;
+            const ivec3 m = n + 1;
+            const ivec3 parent = n / 2;
+
+            // a cell is visited if its parent was flagged
+            std::vector<ivec3> cells;
+            for (int z = 0; z < n.z; z++) {
+                for (int y = 0; y < n.y; y++) {
+                    for (int x = 0; x < n.x; x++) {
+                        const ivec3 c = ivec3(x, y, z) / 2;
+                        if (first || block.refine[(c.z * parent.y + c.y) * parent.x + c.x]) {
+                            cells.emplace_back(x, y, z);
+                        }
+                    }
+                }
+            }
+            PROFILE_COUNT(CellsVisited, cells.size());
+            PROFILE_COUNT(CellsSkippedDistance, n.x * n.y * n.z - cells.size());
+
+            // each corner of a visited cell is sampled once
+            std::vector<int> slots(m.x * m.y * m.z, -1);
+            std::vector<vec3> points;
+            for (const ivec3 &c : cells) {
+                for (const ivec3 &corner : kCellCorners) {
+                    const ivec3 q = c + corner;
+                    int &slot = slots[(q.z * m.y + q.y) * m.x + q.x];
+                    if (slot < 0) {
+                        slot = points.size();
+                        points.push_back(vec3(block.lo + q * step));
+                    }
+                }
+            }
+            std::vector<real> values(points.size());
+            std::vector<int> materials(points.size());
+            tape.Evaluate(points.data(), values.data(), points.size(), materials.data());
+
+            std::vector<uint8_t> refine(step > 1 ? n.x * n.y * n.z : 0, 0);
+            for (const ivec3 &c : cells) {
+                std::array<vec3, 8> p;
+                std::array<real, 8> v;
+                std::array<int, 8> corners;
+                for (int i = 0; i < 8; i++) {
+                    const ivec3 q = c + kCellCorners[i];
+                    corners[i] = slots[(q.z * m.y + q.y) * m.x + q.x];
+                    p[i] = points[corners[i]];
+                    v[i] = values[corners[i]];
+                }
+
+                // color the cell by its corner closest to the surface
+                int nearest = 0;
+                for (int i = 1; i < 8; i++) {
+                    if (std::abs(v[i]) < std::abs(v[nearest])) {
+                        nearest = i;
+                    }
+                }
+                parts[wi].AddCell(block.lo + c * step, p, v,
+                    tape.MaterialColor(materials[corners[nearest]]));
+
+                if (!refine.empty() && std::abs(v[nearest]) <= band) {
+                    refine[(c.z * n.y + c.y) * n.x + c.x] = 1;
+                }
+            }
+            block.refine = std::move(refine);
+        }, numWorkers);
+
+        levelFunc(step, parts);
+        for (TriangleSoup &part : parts) {
+            part.points.clear();
+            part.colors.clear();
+        }
+
+        // blocks with nothing left to refine are done
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [](const Block &block) {
+            return std::find(block.refine.begin(), block.refine.end(), 1) == block.refine.end();
+        }), blocks.end());
+    }
+}
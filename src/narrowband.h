@@ -0,0 +1,236 @@
+#pragma once
+
+// A NarrowBand is a sparse grid of distances around a surface. Space is cut
+// into bricks of kBrickSize^3 lattice cells; only bricks near the surface are
+// stored, each with the distance at all (kBrickSize + 1)^3 of its lattice
+// points. The file format is the in-memory format, so a cached band is used
+// straight from its mapping.
+//
+// Lookups at lattice points return the stored sample. Anywhere else inside a
+// stored cell the 8 corner samples give a Lipschitz lower bound on |d|, which
+// is returned when it proves the sign; otherwise the lookup fails and the
+// caller falls back to an exact query.
+
+uint64_t HashBytes(const void *data, const size_t size, uint64_t hash = 14695981039346656037ull) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class NarrowBand {
+public:
+    static constexpr int kBrickSize = 8;
+    static constexpr int kBrickPoints = kBrickSize + 1;
+    static constexpr int kBrickSamples = kBrickPoints * kBrickPoints * kBrickPoints;
+
+    // bricks are kept when their center is within kBandWidth of the surface
+    // plus the brick's half-diagonal, so every lattice point within
+    // kBandWidth of the surface is stored
+    static constexpr real kBandWidth = 2;
+
+    // points per call to the sampling function
+    static constexpr int kQueryBatch = 64;
+
+    // maps a band saved by Build, or returns null if there is none for key
+    static std::shared_ptr<const NarrowBand> Load(const std::string &path, const uint64_t key) {
+        using namespace boost::interprocess;
+        if (!std::filesystem::exists(path) ||
+            std::filesystem::file_size(path) < sizeof(Header))
+        {
+            return nullptr;
+        }
+        file_mapping fm(path.c_str(), read_only);
+        auto band = std::shared_ptr<NarrowBand>(new NarrowBand(
+            mapped_region(fm, read_only)));
+        const Header &h = band->GetHeader();
+        if (memcmp(h.magic, kMagic, sizeof(h.magic)) != 0 || h.key != key ||
+            band->m_Region.get_size() != FileSize(h))
+        {
+            return nullptr;
+        }
+        return band;
+    }
+
+    // samples the band over the lattice cells [lo, hi) with func, saves it
+    // to path and returns it mapped, or returns null if it could not be
+    // saved. The file is renamed into place, so an interrupted or failed
+    // build never leaves a truncated band behind.
+    static std::shared_ptr<const NarrowBand> Build(
+        const std::string &path, const uint64_t key,
+        const ivec3 &lo, const ivec3 &hi, const BatchDistFunc &func)
+    {
+        Header header;
+        memcpy(header.magic, kMagic, sizeof(header.magic));
+        header.key = key;
+        header.origin = lo;
+        header.count = (hi - lo + kBrickSize - 1) / kBrickSize;
+        const int numCells = header.count.x * header.count.y * header.count.z;
+
+        const auto brickOrigin = [&](const int i) {
+            const ivec3 &c = header.count;
+            const ivec3 index(i % c.x, (i / c.x) % c.y, i / (c.x * c.y));
+            return lo + index * kBrickSize;
+        };
+
+        // find the bricks near the surface, one query per brick center
+        const real halfDiag = kBrickSize * kHalfDiag;
+        std::vector<int32_t> index(numCells);
+        RunWorkers([&](const int wi, const int wn) {
+            const int n = kQueryBatch;
+            std::array<vec3, n> centers;
+            std::array<real, n> d;
+            for (int i = wi * n; i < numCells; i += wn * n) {
+                const int m = std::min(n, numCells - i);
+                for (int j = 0; j < m; j++) {
+                    centers[j] = vec3(brickOrigin(i + j)) + real(kBrickSize) / 2;
+                }
+                func(centers.data(), d.data(), m);
+                for (int j = 0; j < m; j++) {
+                    index[i + j] = std::abs(d[j]) <= halfDiag + kBandWidth;
+                }
+            }
+        });
+        header.numBricks = 0;
+        for (int32_t &i : index) {
+            i = i ? header.numBricks++ : -1;
+        }
+
+        // sample every lattice point of the kept bricks
+        std::vector<float> samples(size_t(header.numBricks) * kBrickSamples);
+        RunWorkers([&](const int wi, const int wn) {
+            std::vector<vec3> points(kBrickSamples);
+            std::vector<real> d(kBrickSamples);
+            for (int i = wi; i < numCells; i += wn) {
+                if (index[i] < 0) {
+                    continue;
+                }
+                const ivec3 origin = brickOrigin(i);
+                int j = 0;
+                for (int z = 0; z < kBrickPoints; z++) {
+                    for (int y = 0; y < kBrickPoints; y++) {
+                        for (int x = 0; x < kBrickPoints; x++) {
+                            points[j++] = vec3(origin + ivec3(x, y, z));
+                        }
+                    }
+                }
+                for (int k = 0; k < kBrickSamples; k += kQueryBatch) {
+                    func(points.data() + k, d.data() + k,
+                        std::min(kQueryBatch, kBrickSamples - k));
+                }
+                std::copy(d.begin(), d.end(),
+                    samples.begin() + size_t(index[i]) * kBrickSamples);
+            }
+        });
+
+        const std::string temp = path + ".tmp";
+        std::error_code error;
+        {
+            std::ofstream file(temp, std::ios_base::binary | std::ios_base::trunc);
+            file.write((const char *)&header, sizeof(header));
+            file.write((const char *)index.data(), index.size() * sizeof(int32_t));
+            file.write((const char *)samples.data(), samples.size() * sizeof(float));
+            file.close();
+            if (!file) {
+                std::filesystem::remove(temp, error);
+                return nullptr;
+            }
+        }
+        std::filesystem::rename(temp, path, error);
+        if (error) {
+            std::filesystem::remove(temp, error);
+            return nullptr;
+        }
+        return Load(path, key);
+    }
+
+    int NumBricks() const {
+        return GetHeader().numBricks;
+    }
+
+    bool Lookup(const vec3 &p, real &d) const {
+        const Header &h = GetHeader();
+        const ivec3 cell = ivec3(glm::floor(p)) - h.origin;
+        const ivec3 brick = cell / kBrickSize;
+        for (int axis = 0; axis < 3; axis++) {
+            if (cell[axis] < 0 || brick[axis] >= h.count[axis]) {
+                return false;
+            }
+        }
+        const int32_t i = Index()[(brick.z * h.count.y + brick.y) * h.count.x + brick.x];
+        if (i < 0) {
+            return false;
+        }
+
+        const float *samples = Samples() + size_t(i) * kBrickSamples;
+        const ivec3 local = cell - brick * kBrickSize;
+        const auto sample = [&](const int x, const int y, const int z) {
+            return samples[((local.z + z) * kBrickPoints + local.y + y) * kBrickPoints + local.x + x];
+        };
+
+        const vec3 f = p - glm::floor(p);
+        if (f == vec3(0)) {
+            d = sample(0, 0, 0);
+            return true;
+        }
+
+        real bound = 0;
+        int sign = 0;
+        for (int z = 0; z < 2; z++) {
+            for (int y = 0; y < 2; y++) {
+                for (int x = 0; x < 2; x++) {
+                    const real s = sample(x, y, z);
+                    const int cornerSign = s < 0 ? -1 : 1;
+                    if (sign != 0 && cornerSign != sign) {
+                        return false;
+                    }
+                    sign = cornerSign;
+                    const real r = glm::distance(f, vec3(x, y, z));
+                    bound = std::max(bound, std::abs(s) - r);
+                }
+            }
+        }
+        if (bound <= 0) {
+            return false;
+        }
+        d = sign * bound;
+        return true;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'S', 'D', 'F', 'B', 'A', 'N', 'D', '1'};
+
+    struct Header {
+        char magic[8];
+        uint64_t key;
+        ivec3 origin;
+        ivec3 count;
+        int32_t numBricks;
+        int32_t padding;
+    };
+
+    static uint64_t FileSize(const Header &h) {
+        return sizeof(Header) +
+            uint64_t(h.count.x) * h.count.y * h.count.z * sizeof(int32_t) +
+            uint64_t(h.numBricks) * kBrickSamples * sizeof(float);
+    }
+
+    explicit NarrowBand(boost::interprocess::mapped_region region) :
+        m_Region(std::move(region)) {}
+
+    const Header &GetHeader() const {
+        return *(const Header *)m_Region.get_address();
+    }
+
+    const int32_t *Index() const {
+        return (const int32_t *)((const uint8_t *)m_Region.get_address() + sizeof(Header));
+    }
+
+    const float *Samples() const {
+        const Header &h = GetHeader();
+        return (const float *)(Index() + h.count.x * h.count.y * h.count.z);
+    }
+
+    boost::interprocess::mapped_region m_Region;
+};
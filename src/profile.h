@@ -0,0 +1,197 @@
+#pragma once
+
+// Opt-in instrumentation, compiled in with -D PROFILE (make profile) and
+// compiled out entirely otherwise: the PROFILE_* macros expand to nothing.
+//
+// Every worker counts into its own block, so counting takes no locks. At exit
+// the blocks are written to profile.json: pipeline counters in total and per
+// worker, and per tape node the number of evaluations and the time spent in
+// its own instructions. Tape nodes are named by their path of SDF3 nodes from
+// the root, and the same times go to profile.folded as collapsed stacks
+// (one "root;child;leaf microseconds" line per node) for flame graph tools.
+
+enum class Counter {
+    CellsVisited,
+    CellsSkippedDistance,
+    CellsSkippedBound,
+    Triangles,
+    EmbreeQueries,
+    EmbreeRetries,
+    NarrowBandHits,
+    NarrowBandMisses,
+};
+
+const int kNumCounters = 8;
+
+const std::array<const char *, kNumCounters> kCounterNames = {{
+    "cells_visited",
+    "cells_skipped_distance",
+    "cells_skipped_bound",
+    "triangles",
+    "embree_queries",
+    "embree_retries",
+    "narrow_band_hits",
+    "narrow_band_misses",
+}};
+
+#ifdef PROFILE
+
+// a tape instruction's node; a node compiled to several instructions counts
+// its evaluations on the first one only
+struct ProfileNode {
+    int id;
+    bool first;
+};
+
+class Profile {
+public:
+    // the id of the tape node at the given stack of SDF3 nodes
+    static int NodeId(const std::string &stack) {
+        Profile &profile = Get();
+        std::lock_guard<std::mutex> guard(profile.m_Mutex);
+        const auto it = std::find(profile.m_Stacks.begin(), profile.m_Stacks.end(), stack);
+        if (it != profile.m_Stacks.end()) {
+            return it - profile.m_Stacks.begin();
+        }
+        profile.m_Stacks.push_back(stack);
+        return profile.m_Stacks.size() - 1;
+    }
+
+    // routes the calling thread's counts to worker i
+    static void SetWorker(const int i) {
+        Profile &profile = Get();
+        std::lock_guard<std::mutex> guard(profile.m_Mutex);
+        LocalBlock() = &profile.m_Blocks[i];
+    }
+
+    static void Count(const Counter counter, const uint64_t n) {
+        Local().counters[int(counter)] += n;
+    }
+
+    static void Node(const ProfileNode &node, const uint64_t evaluations, const uint64_t cycles) {
+        Block &block = Local();
+        if (node.id >= block.nodes.size()) {
+            block.nodes.resize(node.id + 1);
+        }
+        if (node.first) {
+            block.nodes[node.id].evaluations += evaluations;
+        }
+        block.nodes[node.id].cycles += cycles;
+    }
+
+private:
+    struct NodeStats {
+        uint64_t evaluations = 0;
+        uint64_t cycles = 0;
+    };
+
+    struct Block {
+        std::array<uint64_t, kNumCounters> counters{};
+        std::vector<NodeStats> nodes;
+    };
+
+    Profile() :
+        m_StartTime(std::chrono::steady_clock::now()),
+        m_StartCycles(__rdtsc()) {}
+
+    ~Profile() {
+        Write();
+    }
+
+    static Profile &Get() {
+        static Profile profile;
+        return profile;
+    }
+
+    static Block *&LocalBlock() {
+        thread_local Block *block = nullptr;
+        return block;
+    }
+
+    // a thread that never called SetWorker gets a block of its own on first
+    // use, numbered -1, -2, ... in that order
+    static Block &Local() {
+        Block *&block = LocalBlock();
+        if (!block) {
+            Profile &profile = Get();
+            std::lock_guard<std::mutex> guard(profile.m_Mutex);
+            block = &profile.m_Blocks[--profile.m_LastUnnamed];
+        }
+        return *block;
+    }
+
+    void Write() const {
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - m_StartTime;
+        const double secondsPerCycle = elapsed.count() / double(__rdtsc() - m_StartCycles);
+
+        std::array<uint64_t, kNumCounters> totals{};
+        std::vector<NodeStats> nodes(m_Stacks.size());
+        for (const auto &it : m_Blocks) {
+            const Block &block = it.second;
+            for (int i = 0; i < kNumCounters; i++) {
+                totals[i] += block.counters[i];
+            }
+            for (int i = 0; i < block.nodes.size(); i++) {
+                nodes[i].evaluations += block.nodes[i].evaluations;
+                nodes[i].cycles += block.nodes[i].cycles;
+            }
+        }
+
+        const auto writeCounters = [](FILE *fp, const std::array<uint64_t, kNumCounters> &counters) {
+            for (int i = 0; i < kNumCounters; i++) {
+                fprintf(fp, "%s\"%s\": %llu", i ? ", " : "", kCounterNames[i],
+                    (unsigned long long)counters[i]);
+            }
+        };
+
+        FILE *fp = fopen("profile.json", "w");
+        fprintf(fp, "{\n  \"seconds\": %f,\n  \"counters\": {", elapsed.count());
+        writeCounters(fp, totals);
+        fprintf(fp, "},\n  \"workers\": [\n");
+        int i = 0;
+        for (const auto &it : m_Blocks) {
+            fprintf(fp, "    {\"worker\": %d, ", it.first);
+            writeCounters(fp, it.second.counters);
+            fprintf(fp, "}%s\n", ++i < m_Blocks.size() ? "," : "");
+        }
+        fprintf(fp, "  ],\n  \"nodes\": [\n");
+        for (int i = 0; i < nodes.size(); i++) {
+            fprintf(fp, "    {\"stack\": \"%s\", \"evaluations\": %llu, \"cycles\": %llu, \"seconds\": %f}%s\n",
+                m_Stacks[i].c_str(),
+                (unsigned long long)nodes[i].evaluations,
+                (unsigned long long)nodes[i].cycles,
+                nodes[i].cycles * secondsPerCycle,
+                i + 1 < nodes.size() ? "," : "");
+        }
+        fprintf(fp, "  ]\n}\n");
+        fclose(fp);
+
+        fp = fopen("profile.folded", "w");
+        for (int i = 0; i < nodes.size(); i++) {
+            fprintf(fp, "%s %llu\n", m_Stacks[i].c_str(),
+                (unsigned long long)std::llround(nodes[i].cycles * secondsPerCycle * 1e6));
+        }
+        fclose(fp);
+
+        fprintf(stderr, "wrote profile.json and profile.folded\n");
+    }
+
+    std::mutex m_Mutex;
+    std::vector<std::string> m_Stacks;
+    std::map<int, Block> m_Blocks;
+    int m_LastUnnamed = 0;
+    std::chrono::steady_clock::time_point m_StartTime;
+    uint64_t m_StartCycles;
+};
+
+    #define PROFILE_COUNT(counter, n) Profile::Count(Counter::counter, n)
+    #define PROFILE_WORKER(i) Profile::SetWorker(i)
+    #define PROFILE_NODE_BEGIN() const uint64_t profileStart = __rdtsc()
+    #define PROFILE_NODE_END(node, n) Profile::Node(node, n, __rdtsc() - profileStart)
+#else
+    #define PROFILE_COUNT(counter, n)
+    #define PROFILE_WORKER(i)
+    #define PROFILE_NODE_BEGIN()
+    #define PROFILE_NODE_END(node, n)
+#endif
@@ -1,10 +1,21 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <boost/asio/thread_pool.hpp>
@@ -12,6 +23,7 @@
 #include <boost/functional/hash.hpp>
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
+#include <boost/sort/sort.hpp>
 
 #define GLM_FORCE_CTOR_INIT
 #define GLM_ENABLE_EXPERIMENTAL
@@ -25,6 +37,7 @@
 // #include <glm/gtx/string_cast.hpp>
 
 #include <embree4/rtcore.h>
+#include <immintrin.h>
 #include <pmmintrin.h>
 #include <xmmintrin.h>
 
@@ -56,8 +69,16 @@ const vec3 X(1, 0, 0);
 const vec3 Y(0, 1, 0);
 const vec3 Z(0, 0, 1);
 
+#include "profile.h"
 #include "util.h"
+#include "simd.h"
 #include "stl.h"
+#include "writer.h"
 #include "marching.h"
 #include "sdf3.h"
+#include "tape.h"
+#include "mesher.h"
+#include "decimate.h"
+#include "narrowband.h"
+#include "incremental.h"
 #include "embree.h"
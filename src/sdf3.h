@@ -1,37 +1,222 @@
 #pragma once
 
 using DistFunc = std::function<real(const vec3 &)>;
-using ColorFunc = std::function<vec3(const vec3 &)>;
 
-const ColorFunc DefaultColorFunc = [](const vec3 &) {
-    return vec3{0};
+// optional batch form of a DistFunc: out[i] = func(p[i]) for i < n, where
+// the points of one call are usually close together
+using BatchDistFunc = std::function<void(const vec3 *, real *, const int)>;
+
+// SDF3 records an explicit node graph. Evaluating an SDF3 directly walks the
+// graph recursively; for heavy use, and for colors, lower it to a Tape
+// (see tape.h).
+enum class SDF3Op {
+    Custom,
+    Sphere,
+    Cylinder,
+    Plane,
+    Box,
+    Union,
+    Difference,
+    Intersection,
+    Translate,
+    Scale,
+    Rotate,
+};
+
+struct SDF3Node;
+
+using SDF3NodePtr = std::shared_ptr<const SDF3Node>;
+
+struct SDF3Node {
+    explicit SDF3Node(const SDF3Op op) : op(op) {}
+
+    SDF3Op op;
+
+    // operands, meaning depends on op
+    vec3 vector;
+    real scalar = 0;
+    mat3 matrix;
+    DistFunc func;
+    BatchDistFunc batchFunc;
+
+    // identifies a custom function across runs (see incremental.h), 0 if
+    // unknown
+    uint64_t key = 0;
+
+    // children
+    SDF3NodePtr a;
+    SDF3NodePtr b;
+
+    bool hasColor = false;
+    vec3 color;
+
+    // conservative axis-aligned box around the solid (distance <= 0),
+    // unbounded unless the node can tell
+    vec3 boundLo{-std::numeric_limits<real>::infinity()};
+    vec3 boundHi{std::numeric_limits<real>::infinity()};
+
+    // CSG nodes: WorthSkipping(*b), worked out once when the node is made
+    bool skipB = false;
 };
 
+// distance from p to the box [lo, hi], 0 inside
+real BoxDistance(const vec3 &p, const vec3 &lo, const vec3 &hi) {
+    return glm::length(glm::max(glm::max(lo - p, p - hi), real(0)));
+}
+
+// CSG nodes skip their second operand b where b's bounding box alone decides
+// the result, putting the box distance l in place of b's distance (l is a
+// lower bound on the true distance, and b is outside when l > 0). Union and
+// Difference then give what evaluating b would, provided b is an exact SDF
+// (its value is at least l outside the box); for a b that underestimates,
+// the result is still a lower bound on the true distance but may differ.
+// Intersection is not exact either way: it returns max(a, l), a lower
+// bound, and only where l >= kBoundSkipBand, far enough from the surface
+// that the mesher, which reads exact values within a cell diagonal of it,
+// never sees the difference.
+//
+// Point evaluation decides per point. Batched tape evaluation skips only
+// when every lane of a batch decides, so where skipping changes a value
+// (Intersection, or an inexact b) the value depends on which points share
+// the batch.
+const real kBoundSkipBand = 2;
+
+bool BoundDecides(const SDF3Op op, const real a, const real l) {
+    switch (op) {
+    case SDF3Op::Union:
+        return l > 0 && l > a;
+    case SDF3Op::Difference:
+        return l > 0 && l > -a;
+    case SDF3Op::Intersection:
+        return l >= kBoundSkipBand;
+    default:
+        return false;
+    }
+}
+
+// a box test pays off for operands with a bounded box that cost more than
+// one primitive
+bool WorthSkipping(const SDF3Node &node) {
+    const real inf = std::numeric_limits<real>::infinity();
+    const bool bounded =
+        node.boundLo.x > -inf || node.boundLo.y > -inf || node.boundLo.z > -inf ||
+        node.boundHi.x < inf || node.boundHi.y < inf || node.boundHi.z < inf;
+    const SDF3Node *leaf = &node;
+    while (leaf->op == SDF3Op::Translate || leaf->op == SDF3Op::Rotate ||
+        leaf->op == SDF3Op::Scale)
+    {
+        leaf = leaf->a.get();
+    }
+    return bounded && (leaf->op == SDF3Op::Custom ||
+        leaf->op == SDF3Op::Union || leaf->op == SDF3Op::Difference ||
+        leaf->op == SDF3Op::Intersection);
+}
+
+// the box [lo, hi] mapped through m (a linear map), as an axis-aligned box;
+// unbounded sides spread to every axis they feed
+void TransformBounds(const mat3 &m, vec3 &lo, vec3 &hi) {
+    const real inf = std::numeric_limits<real>::infinity();
+    vec3 newLo{0};
+    vec3 newHi{0};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            const real k = m[j][i];
+            if (k == 0) {
+                continue;
+            }
+            const real a = k * lo[j];
+            const real b = k * hi[j];
+            newLo[i] += std::min(a, b);
+            newHi[i] += std::max(a, b);
+        }
+        if (std::isnan(newLo[i]) || std::isnan(newHi[i])) {
+            newLo[i] = -inf;
+            newHi[i] = inf;
+        }
+    }
+    lo = newLo;
+    hi = newHi;
+}
+
+real EvaluateNode(const SDF3Node &node, const vec3 &p) {
+    switch (node.op) {
+    case SDF3Op::Custom:
+        return node.func(p);
+    case SDF3Op::Sphere:
+        return glm::distance(node.vector, p) - node.scalar;
+    case SDF3Op::Cylinder:
+        return glm::length(vec2(p)) - node.scalar;
+    case SDF3Op::Plane:
+        return node.scalar - glm::dot(p, node.vector);
+    case SDF3Op::Box: {
+        const vec3 q = glm::abs(p) - node.vector;
+        return glm::length(glm::max(q, real(0))) + glm::min(glm::max(q.x, glm::max(q.y, q.z)), real(0));
+    }
+    case SDF3Op::Union:
+    case SDF3Op::Difference:
+    case SDF3Op::Intersection: {
+        const real a = EvaluateNode(*node.a, p);
+        const real l = node.skipB ? BoxDistance(p, node.b->boundLo, node.b->boundHi) : 0;
+        const real b = node.skipB && BoundDecides(node.op, a, l) ?
+            l : EvaluateNode(*node.b, p);
+        return
+            node.op == SDF3Op::Union ? std::min(a, b) :
+            node.op == SDF3Op::Difference ? std::max(a, -b) :
+            std::max(a, b);
+    }
+    case SDF3Op::Translate:
+        return EvaluateNode(*node.a, p - node.vector);
+    case SDF3Op::Scale:
+        return EvaluateNode(*node.a, p / node.scalar) * node.scalar;
+    case SDF3Op::Rotate:
+        return EvaluateNode(*node.a, node.matrix * p);
+    }
+    return 0;
+}
+
 class SDF3 {
 public:
     template <typename F>
-    SDF3(const F &f) : m_DistFunc(f), m_ColorFunc(DefaultColorFunc) {}
+    SDF3(const F &f) : SDF3(CustomNode(f)) {}
 
-    SDF3(const DistFunc &distFunc, const ColorFunc &colorFunc) :
-        m_DistFunc(distFunc),
-        m_ColorFunc(colorFunc) {}
+    SDF3(const DistFunc &func, const BatchDistFunc &batchFunc) :
+        SDF3(CustomNode(func, batchFunc)) {}
+
+    explicit SDF3(SDF3Node node) :
+        m_Node(std::make_shared<const SDF3Node>(std::move(node))) {}
 
     real operator()(const vec3 &p) const {
-        return m_DistFunc(p);
+        return EvaluateNode(*m_Node, p);
+    }
+
+    const SDF3NodePtr &GetNode() const {
+        return m_Node;
     }
 
-    vec3 GetColor(const vec3 &p) const {
-        return m_ColorFunc(p);
+    SDF3 &Color(const vec3 &color) {
+        SDF3Node node = *m_Node;
+        node.hasColor = true;
+        node.color = color;
+        m_Node = std::make_shared<const SDF3Node>(std::move(node));
+        return *this;
     }
 
-    ColorFunc GetColorFunc() const {
-        return m_ColorFunc;
+    // declares a box around the solid, for nodes that cannot work it out
+    // (custom functions)
+    SDF3 &Bounds(const vec3 &lo, const vec3 &hi) {
+        SDF3Node node = *m_Node;
+        node.boundLo = lo;
+        node.boundHi = hi;
+        m_Node = std::make_shared<const SDF3Node>(std::move(node));
+        return *this;
     }
 
-    SDF3 &Color(const vec3 &color) {
-        m_ColorFunc = [=](const vec3 &p) -> vec3 {
-            return color;
-        };
+    // names a custom function, so that runs with the same key can reuse
+    // each other's results
+    SDF3 &Key(const uint64_t key) {
+        SDF3Node node = *m_Node;
+        node.key = key;
+        m_Node = std::make_shared<const SDF3Node>(std::move(node));
         return *this;
     }
 
@@ -43,91 +228,101 @@ public:
     }
 
 private:
-    DistFunc m_DistFunc;
-    ColorFunc m_ColorFunc;
+    static SDF3Node CustomNode(
+        const DistFunc &func, const BatchDistFunc &batchFunc = nullptr)
+    {
+        SDF3Node node(SDF3Op::Custom);
+        node.func = func;
+        node.batchFunc = batchFunc;
+        return node;
+    }
+
+    SDF3NodePtr m_Node;
 };
 
 // primitives
 SDF3 Sphere(const real radius = 1, const vec3 &center = vec3{}) {
-    return [=](const vec3 &p) -> real {
-        return glm::distance(center, p) - radius;
-    };
+    SDF3Node node(SDF3Op::Sphere);
+    node.vector = center;
+    node.scalar = radius;
+    node.boundLo = center - radius;
+    node.boundHi = center + radius;
+    return SDF3(node);
 }
 
 SDF3 Cylinder(const real radius = 1) {
-    return [=](const vec3 &p) -> real {
-        return glm::length(vec2(p)) - radius;
-    };
+    SDF3Node node(SDF3Op::Cylinder);
+    node.scalar = radius;
+    node.boundLo = vec3(-radius, -radius, node.boundLo.z);
+    node.boundHi = vec3(radius, radius, node.boundHi.z);
+    return SDF3(node);
 }
 
 SDF3 Plane(const vec3 &normal = Z, const vec3 &point = vec3{}) {
-    return [=](const vec3 &p) -> real {
-        return glm::dot(point - p, normal);
-    };
+    SDF3Node node(SDF3Op::Plane);
+    node.vector = normal;
+    node.scalar = glm::dot(point, normal);
+    return SDF3(node);
 }
 
 SDF3 Box(const vec3 &size = vec3{1}) {
-    return [=](const vec3 &p) -> real {
-        const vec3 q = glm::abs(p) - size;
-        return glm::length(glm::max(q, real(0))) + glm::min(glm::max(q.x, glm::max(q.y, q.z)), real(0));
-    };
+    SDF3Node node(SDF3Op::Box);
+    node.vector = size;
+    node.boundLo = -size;
+    node.boundHi = size;
+    return SDF3(node);
 }
 
 // CSG operations
 SDF3 Union(const SDF3 &a, const SDF3 &b) {
-    const auto d = [=](const vec3 &p) -> real {
-        return std::min(a(p), b(p));
-    };
-    const auto c = [=](const vec3 &p) -> vec3 {
-        if (a(p) < b(p)) {
-            return a.GetColor(p);
-        } else {
-            return b.GetColor(p);
-        }
-    };
-    return SDF3(d, c);
+    SDF3Node node(SDF3Op::Union);
+    node.a = a.GetNode();
+    node.b = b.GetNode();
+    node.boundLo = glm::min(node.a->boundLo, node.b->boundLo);
+    node.boundHi = glm::max(node.a->boundHi, node.b->boundHi);
+    node.skipB = WorthSkipping(*node.b);
+    return SDF3(node);
 }
 
 SDF3 Difference(const SDF3 &a, const SDF3 &b) {
-    const auto d = [=](const vec3 &p) -> real {
-        return std::max(a(p), -b(p));
-    };
-    const auto c = [=](const vec3 &p) -> vec3 {
-        if (a(p) > -b(p)) {
-            return a.GetColor(p);
-        } else {
-            return b.GetColor(p);
-        }
-    };
-    return SDF3(d, c);
+    SDF3Node node(SDF3Op::Difference);
+    node.a = a.GetNode();
+    node.b = b.GetNode();
+    node.boundLo = node.a->boundLo;
+    node.boundHi = node.a->boundHi;
+    node.skipB = WorthSkipping(*node.b);
+    return SDF3(node);
 }
 
 SDF3 Intersection(const SDF3 &a, const SDF3 &b) {
-    const auto d = [=](const vec3 &p) -> real {
-        return std::max(a(p), b(p));
-    };
-    const auto c = [=](const vec3 &p) -> vec3 {
-        if (a(p) > b(p)) {
-            return a.GetColor(p);
-        } else {
-            return b.GetColor(p);
-        }
-    };
-    return SDF3(d, c);
+    SDF3Node node(SDF3Op::Intersection);
+    node.a = a.GetNode();
+    node.b = b.GetNode();
+    node.boundLo = glm::max(node.a->boundLo, node.b->boundLo);
+    node.boundHi = glm::min(node.a->boundHi, node.b->boundHi);
+    node.skipB = WorthSkipping(*node.b);
+    return SDF3(node);
 }
 
 // transforms
 
 SDF3 Translate(const SDF3 &other, const vec3 &offset) {
-    return SDF3([=](const vec3 &p) -> real {
-        return other(p - offset);
-    }, other.GetColorFunc());
+    SDF3Node node(SDF3Op::Translate);
+    node.a = other.GetNode();
+    node.vector = offset;
+    node.boundLo = node.a->boundLo + offset;
+    node.boundHi = node.a->boundHi + offset;
+    return SDF3(node);
 }
 
 SDF3 Scale(const SDF3 &other, const real factor) {
-    return SDF3([=](const vec3 &p) -> real {
-        return other(p / factor) * factor;
-    }, other.GetColorFunc());
+    SDF3Node node(SDF3Op::Scale);
+    node.a = other.GetNode();
+    node.scalar = factor;
+    node.boundLo = node.a->boundLo;
+    node.boundHi = node.a->boundHi;
+    TransformBounds(mat3{factor}, node.boundLo, node.boundHi);
+    return SDF3(node);
 }
 
 SDF3 Rotate(const SDF3 &other, const real angle, const vec3 vector = Z) {
@@ -143,9 +338,15 @@ SDF3 Rotate(const SDF3 &other, const real angle, const vec3 vector = Z) {
         m*x*y - z*s, m*y*y + c, m*y*z + x*s,
         m*z*x + y*s, m*y*z - x*s, m*z*z + c,
     };
-    return SDF3([=](const vec3 &p) -> real {
-        return other(matrix * p);
-    }, other.GetColorFunc());
+    SDF3Node node(SDF3Op::Rotate);
+    node.a = other.GetNode();
+    node.matrix = matrix;
+    // the child is evaluated at matrix * p, so its box maps back through
+    // the inverse (transpose) rotation
+    node.boundLo = node.a->boundLo;
+    node.boundHi = node.a->boundHi;
+    TransformBounds(glm::transpose(matrix), node.boundLo, node.boundHi);
+    return SDF3(node);
 }
 
 // operators
@@ -0,0 +1,79 @@
+#pragma once
+
+// Pack<T> is a SIMD register of floats or doubles, as wide as the target
+// allows: AVX when enabled at compile time (-march=native), SSE otherwise.
+// Float packs hold twice as many lanes as double packs.
+
+#if defined(__AVX__)
+    using PackRegisterF = __m256;
+    using PackRegisterD = __m256d;
+    #define PACK_OP(op, suffix) _mm256_##op##_##suffix
+#else
+    using PackRegisterF = __m128;
+    using PackRegisterD = __m128d;
+    #define PACK_OP(op, suffix) _mm_##op##_##suffix
+#endif
+
+template <typename T>
+struct Pack;
+
+#define DEFINE_PACK(T, Register, suffix)                                    \
+    template <>                                                             \
+    struct Pack<T> {                                                        \
+        static constexpr int kWidth = sizeof(Register) / sizeof(T);         \
+                                                                            \
+        Pack(const Register v) : v(v) {}                                    \
+                                                                            \
+        Pack(const T x) : v(PACK_OP(set1, suffix)(x)) {}                    \
+                                                                            \
+        static Pack Load(const T *p) {                                      \
+            return PACK_OP(loadu, suffix)(p);                               \
+        }                                                                   \
+                                                                            \
+        void Store(T *p) const {                                            \
+            PACK_OP(storeu, suffix)(p, v);                                  \
+        }                                                                   \
+                                                                            \
+        Register v;                                                         \
+    };                                                                      \
+                                                                            \
+    inline Pack<T> operator+(const Pack<T> a, const Pack<T> b) {            \
+        return PACK_OP(add, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> operator-(const Pack<T> a, const Pack<T> b) {            \
+        return PACK_OP(sub, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> operator*(const Pack<T> a, const Pack<T> b) {            \
+        return PACK_OP(mul, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> operator/(const Pack<T> a, const Pack<T> b) {            \
+        return PACK_OP(div, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> operator-(const Pack<T> a) {                             \
+        return PACK_OP(xor, suffix)(a.v, Pack<T>(T(-0.0)).v);               \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> Min(const Pack<T> a, const Pack<T> b) {                  \
+        return PACK_OP(min, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> Max(const Pack<T> a, const Pack<T> b) {                  \
+        return PACK_OP(max, suffix)(a.v, b.v);                              \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> Sqrt(const Pack<T> a) {                                  \
+        return PACK_OP(sqrt, suffix)(a.v);                                  \
+    }                                                                       \
+                                                                            \
+    inline Pack<T> Abs(const Pack<T> a) {                                   \
+        return PACK_OP(andnot, suffix)(Pack<T>(T(-0.0)).v, a.v);            \
+    }
+
+DEFINE_PACK(float, PackRegisterF, ps)
+DEFINE_PACK(double, PackRegisterD, pd)
+
+#undef DEFINE_PACK
@@ -20,55 +20,147 @@ std::vector<vec3> LoadBinarySTL(std::string path) {
     return points;
 }
 
-void SaveBinarySTL(
-    std::string path,
-    const std::vector<vec3> &points,
-    const std::vector<vec3> &colors = std::vector<vec3>{})
+uint16_t EncodeSTLColor(const vec3 &c) {
+    const int r = std::round(glm::clamp(c.r, real(0), real(1)) * 31);
+    const int g = std::round(glm::clamp(c.g, real(0), real(1)) * 31);
+    const int b = std::round(glm::clamp(c.b, real(0), real(1)) * 31);
+    uint16_t result = 1 << 15;
+    result |= r << 10;
+    result |= g << 5;
+    result |= b << 0;
+    return result;
+}
+
+// writes one 50-byte triangle record
+void EncodeSTLTriangle(
+    uint8_t *dst, const vec3 *points, const vec3 *color)
 {
-    using namespace boost::interprocess;
-    const uint32_t numTriangles = points.size() / 3;
-    const uint64_t numBytes = uint64_t(numTriangles) * 50 + 84;
+    const glm::vec3 p0 = points[0];
+    const glm::vec3 p1 = points[1];
+    const glm::vec3 p2 = points[2];
+    const glm::vec3 normal = glm::triangleNormal(p0, p1, p2);
+    memcpy(dst + 0, &normal, 12);
+    memcpy(dst + 12, &p0, 12);
+    memcpy(dst + 24, &p1, 12);
+    memcpy(dst + 36, &p2, 12);
+    const uint16_t attribute = color ? EncodeSTLColor(*color) : 0;
+    memcpy(dst + 48, &attribute, 2);
+}
 
+// STLWriter streams triangles from many threads straight into a mapped
+// binary STL. Each Write reserves a range of records with an atomic add and
+// encodes into it directly; the file grows (and is remapped) on demand and
+// is truncated to its final size by Close.
+//
+// Only the tail of the file past the last Flush is mapped, so flushing
+// between batches of work (e.g. slabs of tiles) bounds the resident output
+// to one batch regardless of the total file size.
+class STLWriter {
+public:
+    explicit STLWriter(const std::string &path) :
+        m_Path(path), m_Count(0), m_Capacity(0), m_Base(0)
     {
-        file_mapping::remove(path.c_str());
-        std::filebuf fbuf;
-        fbuf.open(path.c_str(),
-            std::ios_base::in | std::ios_base::out | std::ios_base::trunc |
-            std::ios_base::binary);
-        fbuf.pubseekoff(numBytes - 1, std::ios_base::beg);
-        fbuf.sputc(0);
+        boost::interprocess::file_mapping::remove(path.c_str());
+        std::ofstream(path, std::ios_base::binary | std::ios_base::trunc);
+        m_Mapping = std::make_unique<boost::interprocess::file_mapping>(
+            path.c_str(), boost::interprocess::read_write);
     }
 
-    file_mapping fm(path.c_str(), read_write);
-    mapped_region mr(fm, read_write);
-    uint8_t *dst = (uint8_t *)mr.get_address();
+    ~STLWriter() {
+        Close();
+    }
 
-    memcpy(dst + 80, &numTriangles, 4);
+    // points holds three vertices per triangle, colors one per triangle
+    // (or is empty)
+    void Write(
+        const std::vector<vec3> &points,
+        const std::vector<vec3> &colors = std::vector<vec3>{})
+    {
+        const uint64_t n = points.size() / 3;
+        if (n == 0) {
+            return;
+        }
+        const uint64_t start = m_Count.fetch_add(n);
 
-    const auto encodeColor = [](const vec3 &c) {
-        const int r = std::round(glm::clamp(c.r, real(0), real(1)) * 31);
-        const int g = std::round(glm::clamp(c.g, real(0), real(1)) * 31);
-        const int b = std::round(glm::clamp(c.b, real(0), real(1)) * 31);
-        uint16_t result = 1 << 15;
-        result |= r << 10;
-        result |= g << 5;
-        result |= b << 0;
-        return result;
-    };
+        std::shared_lock<std::shared_mutex> lock(m_Mutex);
+        while (!m_Region || start + n > m_Capacity) {
+            lock.unlock();
+            Map(start + n);
+            lock.lock();
+        }
 
-    for (uint32_t i = 0; i < numTriangles; i++) {
-        const uint64_t idx = 84 + i * 50;
-        const glm::vec3 p0 = points[i*3+0];
-        const glm::vec3 p1 = points[i*3+1];
-        const glm::vec3 p2 = points[i*3+2];
-        const glm::vec3 normal = glm::triangleNormal(p0, p1, p2);
-        memcpy(dst + idx + 0, &normal, 12);
-        memcpy(dst + idx + 12, &p0, 12);
-        memcpy(dst + idx + 24, &p1, 12);
-        memcpy(dst + idx + 36, &p2, 12);
-        if (i < colors.size()) {
-            const uint16_t color = encodeColor(colors[i]);
-            memcpy(dst + idx + 48, &color, 2);
+        uint8_t *dst = Record(start);
+        for (uint64_t i = 0; i < n; i++) {
+            EncodeSTLTriangle(dst, &points[i*3],
+                i < colors.size() ? &colors[i] : nullptr);
+            dst += 50;
         }
     }
-}
+
+    uint64_t NumTriangles() const {
+        return m_Count;
+    }
+
+    // writes out and unmaps everything written so far; must not overlap
+    // with Write calls
+    void Flush() {
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        if (m_Region) {
+            m_Region->flush();
+            m_Region.reset();
+        }
+        const uint64_t page = boost::interprocess::mapped_region::get_page_size();
+        m_Base = (84 + m_Count * 50) / page * page;
+    }
+
+    // patches the header count and trims the file; call once all writes
+    // are done
+    void Close() {
+        if (!m_Mapping) {
+            return;
+        }
+        m_Region.reset();
+        m_Mapping.reset();
+        const uint32_t numTriangles = m_Count;
+        const uint64_t numBytes = 84 + uint64_t(numTriangles) * 50;
+        std::filesystem::resize_file(m_Path, numBytes);
+        std::fstream file(m_Path,
+            std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        file.seekp(80);
+        file.write((const char *)&numTriangles, 4);
+    }
+
+private:
+    static constexpr uint64_t kInitialCapacity = 1 << 20;
+
+    uint8_t *Record(const uint64_t i) const {
+        return (uint8_t *)m_Region->get_address() + (84 + i * 50 - m_Base);
+    }
+
+    // maps the file from m_Base, growing it to hold at least the given
+    // number of triangles
+    void Map(const uint64_t numTriangles) {
+        using namespace boost::interprocess;
+        std::unique_lock<std::shared_mutex> lock(m_Mutex);
+        if (m_Region && numTriangles <= m_Capacity) {
+            return;
+        }
+        m_Region.reset();
+        if (numTriangles > m_Capacity) {
+            m_Capacity = std::max({
+                numTriangles, m_Capacity * 2, kInitialCapacity});
+            std::filesystem::resize_file(m_Path, 84 + m_Capacity * 50);
+        }
+        const uint64_t numBytes = 84 + m_Capacity * 50 - m_Base;
+        m_Region = std::make_unique<mapped_region>(
+            *m_Mapping, read_write, m_Base, numBytes);
+    }
+
+    std::string m_Path;
+    std::atomic<uint64_t> m_Count;
+    uint64_t m_Capacity;
+    uint64_t m_Base;
+    std::shared_mutex m_Mutex;
+    std::unique_ptr<boost::interprocess::file_mapping> m_Mapping;
+    std::unique_ptr<boost::interprocess::mapped_region> m_Region;
+};
@@ -0,0 +1,849 @@
+#pragma once
+
+// A Tape is an SDF3 node graph lowered to a linear program. Each instruction
+// reads and writes numbered slots: point slots hold (transformed) query
+// points, value slots hold distances. Slot 0 of the point slots is the input.
+//
+// Lowering folds transforms as it goes: translations are pushed down into
+// primitive parameters, and chains of rotations / scales are composed into a
+// single affine instruction per subtree.
+//
+// Colors are lowered to material ids that travel alongside values: a leaf
+// writes its material and a CSG op keeps the material of the operand it
+// picked, so distance and color come out of the same pass.
+//
+// The second operand of a CSG op is preceded by a SkipBox instruction when it
+// has a bounding box and is worth skipping: where the box distance decides
+// the op for every point (see BoundDecides), the box distance stands in for
+// the operand's value and its instructions are jumped over.
+
+enum class TapeOp : uint8_t {
+    Translate,      // p[dst] = p[a] + t
+    Affine,         // p[dst] = M * p[a] + t
+    Custom,         // v[dst] = func(p[a])
+    Sphere,         // v[dst] = sphere(p[a])
+    Cylinder,       // v[dst] = cylinder(p[a])
+    Plane,          // v[dst] = plane(p[a])
+    Box,            // v[dst] = box(p[a])
+    Union,          // v[dst] = min(v[a], v[b])
+    Difference,     // v[dst] = max(v[a], -v[b])
+    Intersection,   // v[dst] = max(v[a], v[b])
+    ScaleDistance,  // v[dst] = v[a] * s
+    SkipBox,        // v[dst] = box distance of p[a], then maybe skip, see above
+};
+
+// conservative range of distances over a region of space
+struct Interval {
+    real lo;
+    real hi;
+};
+
+struct TapeInstruction {
+    TapeOp op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b; // second operand for CSG, material id for primitives
+    uint32_t k; // offset into constants, or index into funcs for Custom
+};
+
+class Tape {
+public:
+    explicit Tape(const SDF3 &sdf) : m_Materials{vec3{0}} {
+        Compile(*sdf.GetNode(), 0, 0, Transform{}, -1);
+        m_FloatConstants.assign(m_Constants.begin(), m_Constants.end());
+    }
+
+    real operator()(const vec3 &p) const {
+        int material;
+        return EvaluatePoint<false>(p, material);
+    }
+
+    // returns the distance at p and the material id of the surface it
+    // belongs to, see MaterialColor
+    real Evaluate(const vec3 &p, int &material) const {
+        return EvaluatePoint<true>(p, material);
+    }
+
+    vec3 GetColor(const vec3 &p) const {
+        int material;
+        Evaluate(p, material);
+        return MaterialColor(material);
+    }
+
+    const vec3 &MaterialColor(const int material) const {
+        return m_Materials[material];
+    }
+
+    // evaluates n points at once, in blocks of kBatchSize, using SIMD kernels
+    // over structure-of-arrays registers (custom nodes get the whole block
+    // through their batch function if they have one, else go point by point).
+    // Material ids are written to materials when it is not null.
+    //
+    // T selects the precision of the kernels: float runs twice as many lanes
+    // per instruction as double, at the cost of ~1e-7 relative error in
+    // points and distances.
+    template <typename T>
+    void Evaluate(const vec3 *p, T *out, const int n, int *materials = nullptr) const {
+        // both register files get the same number of rows so that slot
+        // indices of either kind stay in bounds
+        thread_local std::vector<T> scratch;
+        thread_local std::vector<int> materialScratch;
+        const int slots = std::max(m_NumValues, m_NumPoints);
+        scratch.resize(size_t(slots) * 4 * kBatchSize);
+        T *values = scratch.data();
+        T *points = values + slots * kBatchSize;
+        int *ids = nullptr;
+        if (materials) {
+            materialScratch.resize(size_t(slots) * kBatchSize);
+            ids = materialScratch.data();
+        }
+        for (int i = 0; i < n; i += kBatchSize) {
+            const int m = std::min(kBatchSize, n - i);
+            EvaluateBatch(p + i, out + i, materials ? materials + i : nullptr,
+                m, values, points, ids);
+        }
+    }
+
+    // returns a conservative interval containing every distance over the
+    // axis-aligned box [lo, hi]; custom nodes are assumed to be 1-Lipschitz
+    Interval Bound(const vec3 &lo, const vec3 &hi) const {
+        if (m_NumValues <= kInlineSlots && m_NumPoints <= kInlineSlots) {
+            std::array<Interval, kInlineSlots> values;
+            std::array<vec3, kInlineSlots> lows;
+            std::array<vec3, kInlineSlots> highs;
+            return RunBound(lo, hi, values.data(), lows.data(), highs.data());
+        }
+        const int slots = std::max(m_NumValues, m_NumPoints);
+        std::vector<Interval> values(slots);
+        std::vector<vec3> lows(slots);
+        std::vector<vec3> highs(slots);
+        return RunBound(lo, hi, values.data(), lows.data(), highs.data());
+    }
+
+    int NumInstructions() const {
+        return m_Instructions.size();
+    }
+
+    void Dump(FILE *fp = stderr) const {
+        static const char *names[] = {
+            "translate", "affine", "custom", "sphere", "cylinder", "plane",
+            "box", "union", "difference", "intersection", "scale", "skipbox",
+        };
+        fprintf(fp, "tape: %d instructions, %d values, %d points\n",
+            NumInstructions(), m_NumValues, m_NumPoints);
+        for (int i = 0; i < m_Instructions.size(); i++) {
+            const TapeInstruction &in = m_Instructions[i];
+            const char *name = names[int(in.op)];
+            switch (in.op) {
+            case TapeOp::Translate:
+            case TapeOp::Affine:
+                fprintf(fp, "%4d  p%d = %s p%d\n", i, in.dst, name, in.a);
+                break;
+            case TapeOp::Union:
+            case TapeOp::Difference:
+            case TapeOp::Intersection:
+                fprintf(fp, "%4d  v%d = %s v%d v%d\n", i, in.dst, name, in.a, in.b);
+                break;
+            case TapeOp::ScaleDistance:
+                fprintf(fp, "%4d  v%d = %s v%d %g\n", i, in.dst, name, in.a,
+                    double(m_Constants[in.k]));
+                break;
+            case TapeOp::SkipBox:
+                fprintf(fp, "%4d  v%d = %s p%d v%d +%d\n", i, in.dst, name, in.a, in.b,
+                    SkipLength(in));
+                break;
+            default:
+                fprintf(fp, "%4d  v%d = %s p%d\n", i, in.dst, name, in.a);
+                break;
+            }
+        }
+    }
+
+private:
+    static constexpr int kInlineSlots = 16;
+    static constexpr int kBatchSize = 64;
+
+    // pending transform to apply to the current point slot: M * p + t,
+    // with resulting distances multiplied by scale
+    struct Transform {
+        bool linear = false;
+        mat3 matrix;
+        vec3 offset;
+        real scale = 1;
+    };
+
+    // SkipBox constants: the box (lo, hi), then the number of instructions
+    // of the operand it guards; the CSG op follows them
+    int SkipLength(const TapeInstruction &in) const {
+        return int(m_Constants[in.k + 6]);
+    }
+
+    SDF3Op SkipOp(const int i) const {
+        const TapeOp op = m_Instructions[i + 1 + SkipLength(m_Instructions[i])].op;
+        return
+            op == TapeOp::Union ? SDF3Op::Union :
+            op == TapeOp::Difference ? SDF3Op::Difference :
+            SDF3Op::Intersection;
+    }
+
+    // instruction constants in the precision of the batch kernels
+    template <typename T>
+    const T *Constants() const {
+        if constexpr (std::is_same<T, real>::value) {
+            return m_Constants.data();
+        } else {
+            return m_FloatConstants.data();
+        }
+    }
+
+    template <bool kMaterials>
+    real EvaluatePoint(const vec3 &p, int &material) const {
+        if (m_NumValues <= kInlineSlots && m_NumPoints <= kInlineSlots) {
+            std::array<real, kInlineSlots> values;
+            std::array<vec3, kInlineSlots> points;
+            std::array<int, kInlineSlots> materials;
+            const real d = Run<kMaterials>(p, values.data(), points.data(), materials.data());
+            if (kMaterials) {
+                material = materials[0];
+            }
+            return d;
+        }
+        std::vector<real> values(m_NumValues);
+        std::vector<vec3> points(m_NumPoints);
+        std::vector<int> materials(m_NumValues);
+        const real d = Run<kMaterials>(p, values.data(), points.data(), materials.data());
+        if (kMaterials) {
+            material = materials[0];
+        }
+        return d;
+    }
+
+    template <bool kMaterials>
+    real Run(const vec3 &p, real *v, vec3 *q, int *m) const {
+        q[0] = p;
+        for (int i = 0; i < m_Instructions.size(); i++) {
+            const TapeInstruction &in = m_Instructions[i];
+            PROFILE_NODE_BEGIN();
+            if (kMaterials && in.op >= TapeOp::Custom && in.op <= TapeOp::Box) {
+                m[in.dst] = in.b;
+            }
+            const real *k = m_Constants.data() + in.k;
+            switch (in.op) {
+            case TapeOp::Translate:
+                q[in.dst] = q[in.a] + vec3(k[0], k[1], k[2]);
+                break;
+            case TapeOp::Affine: {
+                const vec3 &r = q[in.a];
+                q[in.dst] = vec3(
+                    k[0] * r.x + k[3] * r.y + k[6] * r.z + k[9],
+                    k[1] * r.x + k[4] * r.y + k[7] * r.z + k[10],
+                    k[2] * r.x + k[5] * r.y + k[8] * r.z + k[11]);
+                break;
+            }
+            case TapeOp::Custom:
+                v[in.dst] = m_Funcs[in.k](q[in.a]);
+                break;
+            case TapeOp::Sphere:
+                v[in.dst] = glm::distance(vec3(k[0], k[1], k[2]), q[in.a]) - k[3];
+                break;
+            case TapeOp::Cylinder:
+                v[in.dst] = glm::length(vec2(q[in.a]) - vec2(k[0], k[1])) - k[2];
+                break;
+            case TapeOp::Plane:
+                v[in.dst] = k[3] - glm::dot(q[in.a], vec3(k[0], k[1], k[2]));
+                break;
+            case TapeOp::Box: {
+                const vec3 d = glm::abs(q[in.a] - vec3(k[0], k[1], k[2])) - vec3(k[3], k[4], k[5]);
+                v[in.dst] = glm::length(glm::max(d, real(0))) + glm::min(glm::max(d.x, glm::max(d.y, d.z)), real(0));
+                break;
+            }
+            case TapeOp::Union:
+                if (kMaterials) {
+                    m[in.dst] = v[in.a] < v[in.b] ? m[in.a] : m[in.b];
+                }
+                v[in.dst] = std::min(v[in.a], v[in.b]);
+                break;
+            case TapeOp::Difference:
+                if (kMaterials) {
+                    m[in.dst] = v[in.a] > -v[in.b] ? m[in.a] : m[in.b];
+                }
+                v[in.dst] = std::max(v[in.a], -v[in.b]);
+                break;
+            case TapeOp::Intersection:
+                if (kMaterials) {
+                    m[in.dst] = v[in.a] > v[in.b] ? m[in.a] : m[in.b];
+                }
+                v[in.dst] = std::max(v[in.a], v[in.b]);
+                break;
+            case TapeOp::ScaleDistance:
+                v[in.dst] = v[in.a] * k[0];
+                break;
+            case TapeOp::SkipBox:
+                v[in.dst] = BoxDistance(q[in.a], vec3(k[0], k[1], k[2]), vec3(k[3], k[4], k[5]));
+                if (BoundDecides(SkipOp(i), v[in.b], v[in.dst])) {
+                    if (kMaterials) {
+                        m[in.dst] = m[in.b];
+                    }
+                    i += SkipLength(in);
+                }
+                break;
+            }
+            PROFILE_NODE_END(m_ProfileNodes[&in - m_Instructions.data()], 1);
+        }
+        return v[0];
+    }
+
+    // points become boxes (qlo, qhi) and values become intervals
+    Interval RunBound(
+        const vec3 &lo, const vec3 &hi, Interval *v, vec3 *qlo, vec3 *qhi) const
+    {
+        qlo[0] = lo;
+        qhi[0] = hi;
+        for (int i = 0; i < m_Instructions.size(); i++) {
+            const TapeInstruction &in = m_Instructions[i];
+            const real *k = m_Constants.data() + in.k;
+            const vec3 &a = qlo[in.a];
+            const vec3 &b = qhi[in.a];
+            switch (in.op) {
+            case TapeOp::Translate: {
+                const vec3 t(k[0], k[1], k[2]);
+                qlo[in.dst] = a + t;
+                qhi[in.dst] = b + t;
+                break;
+            }
+            case TapeOp::Affine: {
+                const vec3 c = (a + b) * real(0.5);
+                const vec3 h = (b - a) * real(0.5);
+                const vec3 mc(
+                    k[0] * c.x + k[3] * c.y + k[6] * c.z + k[9],
+                    k[1] * c.x + k[4] * c.y + k[7] * c.z + k[10],
+                    k[2] * c.x + k[5] * c.y + k[8] * c.z + k[11]);
+                const vec3 mh(
+                    std::abs(k[0]) * h.x + std::abs(k[3]) * h.y + std::abs(k[6]) * h.z,
+                    std::abs(k[1]) * h.x + std::abs(k[4]) * h.y + std::abs(k[7]) * h.z,
+                    std::abs(k[2]) * h.x + std::abs(k[5]) * h.y + std::abs(k[8]) * h.z);
+                qlo[in.dst] = mc - mh;
+                qhi[in.dst] = mc + mh;
+                break;
+            }
+            case TapeOp::Custom: {
+                const real d = m_Funcs[in.k]((a + b) * real(0.5));
+                const real r = glm::length(b - a) * real(0.5);
+                v[in.dst] = Interval{d - r, d + r};
+                break;
+            }
+            case TapeOp::Sphere: {
+                const vec3 c(k[0], k[1], k[2]);
+                const vec3 near = glm::max(glm::max(a - c, c - b), real(0));
+                const vec3 far = glm::max(glm::abs(a - c), glm::abs(b - c));
+                v[in.dst] = Interval{glm::length(near) - k[3], glm::length(far) - k[3]};
+                break;
+            }
+            case TapeOp::Cylinder: {
+                const vec2 c(k[0], k[1]);
+                const vec2 near(
+                    std::max(std::max(a.x - c.x, c.x - b.x), real(0)),
+                    std::max(std::max(a.y - c.y, c.y - b.y), real(0)));
+                const vec2 far(
+                    std::max(std::abs(a.x - c.x), std::abs(b.x - c.x)),
+                    std::max(std::abs(a.y - c.y), std::abs(b.y - c.y)));
+                v[in.dst] = Interval{glm::length(near) - k[2], glm::length(far) - k[2]};
+                break;
+            }
+            case TapeOp::Plane: {
+                const vec3 n(k[0], k[1], k[2]);
+                const real c = glm::dot((a + b) * real(0.5), n);
+                const real h = glm::dot((b - a) * real(0.5), glm::abs(n));
+                v[in.dst] = Interval{k[3] - c - h, k[3] - c + h};
+                break;
+            }
+            case TapeOp::Box: {
+                // the box distance is monotonic in each |p - center| component
+                const vec3 c(k[0], k[1], k[2]);
+                const vec3 s(k[3], k[4], k[5]);
+                const vec3 da = glm::abs(a - c);
+                const vec3 db = glm::abs(b - c);
+                vec3 near = glm::min(da, db);
+                for (int i = 0; i < 3; i++) {
+                    if (a[i] <= c[i] && b[i] >= c[i]) {
+                        near[i] = 0;
+                    }
+                }
+                const vec3 dl = near - s;
+                const vec3 dh = glm::max(da, db) - s;
+                v[in.dst] = Interval{
+                    glm::length(glm::max(dl, real(0))) + glm::min(glm::max(dl.x, glm::max(dl.y, dl.z)), real(0)),
+                    glm::length(glm::max(dh, real(0))) + glm::min(glm::max(dh.x, glm::max(dh.y, dh.z)), real(0)),
+                };
+                break;
+            }
+            case TapeOp::Union:
+                v[in.dst] = Interval{
+                    std::min(v[in.a].lo, v[in.b].lo),
+                    std::min(v[in.a].hi, v[in.b].hi)};
+                break;
+            case TapeOp::Difference:
+                v[in.dst] = Interval{
+                    std::max(v[in.a].lo, -v[in.b].hi),
+                    std::max(v[in.a].hi, -v[in.b].lo)};
+                break;
+            case TapeOp::Intersection:
+                v[in.dst] = Interval{
+                    std::max(v[in.a].lo, v[in.b].lo),
+                    std::max(v[in.a].hi, v[in.b].hi)};
+                break;
+            case TapeOp::ScaleDistance: {
+                const real lo = v[in.a].lo * k[0];
+                const real hi = v[in.a].hi * k[0];
+                v[in.dst] = Interval{std::min(lo, hi), std::max(lo, hi)};
+                break;
+            }
+            case TapeOp::SkipBox: {
+                // a region outside the operand's box is outside the operand,
+                // which settles the sign of every CSG op over it
+                const vec3 gap = glm::max(glm::max(
+                    vec3(k[0], k[1], k[2]) - b, a - vec3(k[3], k[4], k[5])), real(0));
+                const real d = glm::length(gap);
+                if (d > 0) {
+                    v[in.dst] = Interval{d, std::numeric_limits<real>::infinity()};
+                    i += SkipLength(in);
+                }
+                break;
+            }
+            }
+        }
+        return v[0];
+    }
+
+    // values: one row of kBatchSize lanes per value slot
+    // points: three rows (x, y, z) of kBatchSize lanes per point slot
+    // ids: one row of material ids per value slot, or null
+    template <typename T>
+    void EvaluateBatch(
+        const vec3 *p, T *out, int *materials, const int m,
+        T *values, T *points, int *ids) const
+    {
+        using Pack = ::Pack<T>;
+        constexpr int W = Pack::kWidth;
+        const int w = (m + W - 1) / W * W;
+
+        const auto V = [values](const int i) {
+            return values + i * kBatchSize;
+        };
+        const auto P = [points](const int i, const int axis) {
+            return points + (i * 3 + axis) * kBatchSize;
+        };
+        const auto M = [ids](const int i) {
+            return ids + i * kBatchSize;
+        };
+
+        for (int j = 0; j < w; j++) {
+            const vec3 &r = p[std::min(j, m - 1)];
+            P(0, 0)[j] = r.x;
+            P(0, 1)[j] = r.y;
+            P(0, 2)[j] = r.z;
+        }
+
+        for (int i = 0; i < m_Instructions.size(); i++) {
+            const TapeInstruction &in = m_Instructions[i];
+            PROFILE_NODE_BEGIN();
+            const T *k = Constants<T>() + in.k;
+            const T *x = P(in.a, 0);
+            const T *y = P(in.a, 1);
+            const T *z = P(in.a, 2);
+            T *d = V(in.dst);
+            if (ids) {
+                SelectMaterials(in, w, V(in.a), V(in.b), M(in.a), M(in.b), M(in.dst));
+            }
+            switch (in.op) {
+            case TapeOp::Translate: {
+                T *dx = P(in.dst, 0);
+                T *dy = P(in.dst, 1);
+                T *dz = P(in.dst, 2);
+                const Pack tx(k[0]), ty(k[1]), tz(k[2]);
+                for (int j = 0; j < w; j += W) {
+                    (Pack::Load(x + j) + tx).Store(dx + j);
+                    (Pack::Load(y + j) + ty).Store(dy + j);
+                    (Pack::Load(z + j) + tz).Store(dz + j);
+                }
+                break;
+            }
+            case TapeOp::Affine: {
+                T *dx = P(in.dst, 0);
+                T *dy = P(in.dst, 1);
+                T *dz = P(in.dst, 2);
+                const Pack m0(k[0]), m1(k[1]), m2(k[2]);
+                const Pack m3(k[3]), m4(k[4]), m5(k[5]);
+                const Pack m6(k[6]), m7(k[7]), m8(k[8]);
+                const Pack tx(k[9]), ty(k[10]), tz(k[11]);
+                for (int j = 0; j < w; j += W) {
+                    const Pack px = Pack::Load(x + j);
+                    const Pack py = Pack::Load(y + j);
+                    const Pack pz = Pack::Load(z + j);
+                    (m0 * px + m3 * py + m6 * pz + tx).Store(dx + j);
+                    (m1 * px + m4 * py + m7 * pz + ty).Store(dy + j);
+                    (m2 * px + m5 * py + m8 * pz + tz).Store(dz + j);
+                }
+                break;
+            }
+            case TapeOp::Custom: {
+                const BatchDistFunc &batchFunc = m_BatchFuncs[in.k];
+                if (!batchFunc) {
+                    for (int j = 0; j < m; j++) {
+                        d[j] = m_Funcs[in.k](vec3(x[j], y[j], z[j]));
+                    }
+                    break;
+                }
+                std::array<vec3, kBatchSize> q;
+                std::array<real, kBatchSize> r;
+                for (int j = 0; j < m; j++) {
+                    q[j] = vec3(x[j], y[j], z[j]);
+                }
+                batchFunc(q.data(), r.data(), m);
+                std::copy(r.data(), r.data() + m, d);
+                break;
+            }
+            case TapeOp::Sphere: {
+                const Pack cx(k[0]), cy(k[1]), cz(k[2]), r(k[3]);
+                for (int j = 0; j < w; j += W) {
+                    const Pack dx = cx - Pack::Load(x + j);
+                    const Pack dy = cy - Pack::Load(y + j);
+                    const Pack dz = cz - Pack::Load(z + j);
+                    (Sqrt(dx * dx + dy * dy + dz * dz) - r).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Cylinder: {
+                const Pack cx(k[0]), cy(k[1]), r(k[2]);
+                for (int j = 0; j < w; j += W) {
+                    const Pack dx = Pack::Load(x + j) - cx;
+                    const Pack dy = Pack::Load(y + j) - cy;
+                    (Sqrt(dx * dx + dy * dy) - r).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Plane: {
+                const Pack nx(k[0]), ny(k[1]), nz(k[2]), c(k[3]);
+                for (int j = 0; j < w; j += W) {
+                    const Pack px = Pack::Load(x + j);
+                    const Pack py = Pack::Load(y + j);
+                    const Pack pz = Pack::Load(z + j);
+                    (c - (px * nx + py * ny + pz * nz)).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Box: {
+                const Pack cx(k[0]), cy(k[1]), cz(k[2]);
+                const Pack sx(k[3]), sy(k[4]), sz(k[5]);
+                const Pack zero(T(0));
+                for (int j = 0; j < w; j += W) {
+                    const Pack dx = Abs(Pack::Load(x + j) - cx) - sx;
+                    const Pack dy = Abs(Pack::Load(y + j) - cy) - sy;
+                    const Pack dz = Abs(Pack::Load(z + j) - cz) - sz;
+                    const Pack ox = Max(dx, zero);
+                    const Pack oy = Max(dy, zero);
+                    const Pack oz = Max(dz, zero);
+                    const Pack inside = Min(Max(dx, Max(dy, dz)), zero);
+                    (Sqrt(ox * ox + oy * oy + oz * oz) + inside).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Union: {
+                const T *a = V(in.a);
+                const T *b = V(in.b);
+                for (int j = 0; j < w; j += W) {
+                    Min(Pack::Load(a + j), Pack::Load(b + j)).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Difference: {
+                const T *a = V(in.a);
+                const T *b = V(in.b);
+                for (int j = 0; j < w; j += W) {
+                    Max(Pack::Load(a + j), -Pack::Load(b + j)).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::Intersection: {
+                const T *a = V(in.a);
+                const T *b = V(in.b);
+                for (int j = 0; j < w; j += W) {
+                    Max(Pack::Load(a + j), Pack::Load(b + j)).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::ScaleDistance: {
+                const T *a = V(in.a);
+                const Pack s(k[0]);
+                for (int j = 0; j < w; j += W) {
+                    (Pack::Load(a + j) * s).Store(d + j);
+                }
+                break;
+            }
+            case TapeOp::SkipBox: {
+                const Pack lx(k[0]), ly(k[1]), lz(k[2]);
+                const Pack hx(k[3]), hy(k[4]), hz(k[5]);
+                const Pack zero(T(0));
+                for (int j = 0; j < w; j += W) {
+                    const Pack px = Pack::Load(x + j);
+                    const Pack py = Pack::Load(y + j);
+                    const Pack pz = Pack::Load(z + j);
+                    const Pack dx = Max(Max(lx - px, px - hx), zero);
+                    const Pack dy = Max(Max(ly - py, py - hy), zero);
+                    const Pack dz = Max(Max(lz - pz, pz - hz), zero);
+                    Sqrt(dx * dx + dy * dy + dz * dz).Store(d + j);
+                }
+                // the operand is skipped only if the box decides every lane
+                const SDF3Op op = SkipOp(i);
+                const T *a = V(in.b);
+                int j = 0;
+                while (j < m && BoundDecides(op, a[j], d[j])) {
+                    j++;
+                }
+                if (j == m) {
+                    if (ids) {
+                        std::copy(M(in.b), M(in.b) + w, M(in.dst));
+                    }
+                    i += SkipLength(in);
+                }
+                break;
+            }
+            }
+            PROFILE_NODE_END(m_ProfileNodes[&in - m_Instructions.data()], m);
+        }
+
+        std::copy(V(0), V(0) + m, out);
+        if (ids) {
+            std::copy(M(0), M(0) + m, materials);
+        }
+    }
+
+    // material ids of one instruction over w lanes, before its values are
+    // written (dst may alias an operand)
+    template <typename T>
+    static void SelectMaterials(
+        const TapeInstruction &in, const int w,
+        const T *a, const T *b, const int *ma, const int *mb, int *dst)
+    {
+        switch (in.op) {
+        case TapeOp::Custom:
+        case TapeOp::Sphere:
+        case TapeOp::Cylinder:
+        case TapeOp::Plane:
+        case TapeOp::Box:
+            std::fill(dst, dst + w, int(in.b));
+            break;
+        case TapeOp::Union:
+            for (int j = 0; j < w; j++) {
+                dst[j] = a[j] < b[j] ? ma[j] : mb[j];
+            }
+            break;
+        case TapeOp::Difference:
+            for (int j = 0; j < w; j++) {
+                dst[j] = a[j] > -b[j] ? ma[j] : mb[j];
+            }
+            break;
+        case TapeOp::Intersection:
+            for (int j = 0; j < w; j++) {
+                dst[j] = a[j] > b[j] ? ma[j] : mb[j];
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void Emit(const TapeOp op, const int dst, const int a, const int b,
+        const std::initializer_list<real> constants)
+    {
+        assert(dst < 65536 && a < 65536 && b < 65536);
+        m_Instructions.push_back(TapeInstruction{
+            op, uint16_t(dst), uint16_t(a), uint16_t(b),
+            uint32_t(m_Constants.size())});
+        m_Constants.insert(m_Constants.end(), constants);
+#ifdef PROFILE
+        AddProfileId();
+#endif
+    }
+
+    // applies the pending transform into point slot `point + 1`,
+    // returns the slot the primitive should read from
+    int Materialize(Transform &t, const int point, const bool keepOffset) {
+        if (t.linear) {
+            const mat3 &m = t.matrix;
+            const vec3 &o = t.offset;
+            Emit(TapeOp::Affine, point + 1, point, 0, {
+                m[0][0], m[0][1], m[0][2],
+                m[1][0], m[1][1], m[1][2],
+                m[2][0], m[2][1], m[2][2],
+                o.x, o.y, o.z});
+        } else if (!keepOffset && t.offset != vec3{0}) {
+            const vec3 &o = t.offset;
+            Emit(TapeOp::Translate, point + 1, point, 0, {o.x, o.y, o.z});
+        } else {
+            return point;
+        }
+        m_NumPoints = std::max(m_NumPoints, point + 2);
+        t.linear = false;
+        t.matrix = mat3{};
+        t.offset = vec3{0};
+        return point + 1;
+    }
+
+    int AddMaterial(const vec3 &color) {
+        for (int i = 0; i < m_Materials.size(); i++) {
+            if (m_Materials[i] == color) {
+                return i;
+            }
+        }
+        m_Materials.push_back(color);
+        return m_Materials.size() - 1;
+    }
+
+#ifdef PROFILE
+    // names the node being compiled by its position in the graph, so
+    // instructions can be attributed to it
+    void Compile(
+        const SDF3Node &node, const int value, const int point, const Transform &t,
+        const int material)
+    {
+        static const char *names[] = {
+            "custom", "sphere", "cylinder", "plane", "box", "union",
+            "difference", "intersection", "translate", "scale", "rotate",
+        };
+        const std::string name = names[int(node.op)] +
+            std::string("#") + std::to_string(m_NumProfileNodes++);
+        m_ProfileStack.push_back(m_ProfileStack.empty() ?
+            name : m_ProfileStack.back() + ";" + name);
+        CompileNode(node, value, point, t, material);
+        m_ProfileStack.pop_back();
+    }
+
+    void AddProfileId() {
+        const int id = Profile::NodeId(m_ProfileStack.back());
+        const bool first = std::none_of(m_ProfileNodes.begin(), m_ProfileNodes.end(),
+            [id](const ProfileNode &node) { return node.id == id; });
+        m_ProfileNodes.push_back(ProfileNode{id, first});
+    }
+#else
+    void Compile(
+        const SDF3Node &node, const int value, const int point, const Transform &t,
+        const int material)
+    {
+        CompileNode(node, value, point, t, material);
+    }
+#endif
+
+    // material is the id forced by the outermost colored ancestor, or -1
+    void CompileNode(
+        const SDF3Node &node, const int value, int point, Transform t, int material)
+    {
+        m_NumValues = std::max(m_NumValues, value + 1);
+        if (material < 0 && node.hasColor) {
+            material = AddMaterial(node.color);
+        }
+
+        switch (node.op) {
+        case SDF3Op::Translate:
+            t.offset -= node.vector;
+            Compile(*node.a, value, point, t, material);
+            return;
+        case SDF3Op::Rotate:
+            t.matrix = t.linear ? node.matrix * t.matrix : node.matrix;
+            t.offset = node.matrix * t.offset;
+            t.linear = true;
+            Compile(*node.a, value, point, t, material);
+            return;
+        case SDF3Op::Scale:
+            t.matrix = t.linear ? t.matrix / node.scalar : mat3{1 / node.scalar};
+            t.offset /= node.scalar;
+            t.linear = true;
+            t.scale *= node.scalar;
+            Compile(*node.a, value, point, t, material);
+            return;
+        default:
+            break;
+        }
+
+        // translations are folded into primitive parameters
+        const real scale = t.scale;
+        t.scale = 1;
+        point = Materialize(t, point, node.op != SDF3Op::Custom);
+        const vec3 &o = t.offset;
+        const int leafMaterial = std::max(material, 0);
+
+        switch (node.op) {
+        case SDF3Op::Custom:
+            m_Instructions.push_back(TapeInstruction{
+                TapeOp::Custom, uint16_t(value), uint16_t(point),
+                uint16_t(leafMaterial), uint32_t(m_Funcs.size())});
+            m_Funcs.push_back(node.func);
+            m_BatchFuncs.push_back(node.batchFunc);
+#ifdef PROFILE
+            AddProfileId();
+#endif
+            break;
+        case SDF3Op::Sphere: {
+            const vec3 c = node.vector - o;
+            Emit(TapeOp::Sphere, value, point, leafMaterial, {c.x, c.y, c.z, node.scalar});
+            break;
+        }
+        case SDF3Op::Cylinder:
+            Emit(TapeOp::Cylinder, value, point, leafMaterial, {-o.x, -o.y, node.scalar});
+            break;
+        case SDF3Op::Plane: {
+            const vec3 &n = node.vector;
+            Emit(TapeOp::Plane, value, point, leafMaterial, {n.x, n.y, n.z, node.scalar - glm::dot(o, n)});
+            break;
+        }
+        case SDF3Op::Box: {
+            const vec3 &s = node.vector;
+            Emit(TapeOp::Box, value, point, leafMaterial, {-o.x, -o.y, -o.z, s.x, s.y, s.z});
+            break;
+        }
+        case SDF3Op::Union:
+        case SDF3Op::Difference:
+        case SDF3Op::Intersection: {
+            const TapeOp op =
+                node.op == SDF3Op::Union ? TapeOp::Union :
+                node.op == SDF3Op::Difference ? TapeOp::Difference :
+                TapeOp::Intersection;
+            Compile(*node.a, value, point, t, material);
+            if (!node.skipB) {
+                Compile(*node.b, value + 1, point, t, material);
+            } else {
+                // the box moves into the space of the current point slot
+                const vec3 lo = node.b->boundLo - o;
+                const vec3 hi = node.b->boundHi - o;
+                const int skip = m_Instructions.size();
+                Emit(TapeOp::SkipBox, value + 1, point, value, {
+                    lo.x, lo.y, lo.z, hi.x, hi.y, hi.z, 0});
+                Compile(*node.b, value + 1, point, t, material);
+                m_Constants[m_Instructions[skip].k + 6] = m_Instructions.size() - skip - 1;
+            }
+            Emit(op, value, value, value + 1, {});
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (scale != 1) {
+            Emit(TapeOp::ScaleDistance, value, value, 0, {scale});
+        }
+    }
+
+    std::vector<TapeInstruction> m_Instructions;
+    std::vector<real> m_Constants;
+    std::vector<float> m_FloatConstants;
+    std::vector<DistFunc> m_Funcs;
+    std::vector<BatchDistFunc> m_BatchFuncs;
+    std::vector<vec3> m_Materials;
+    int m_NumValues = 0;
+    int m_NumPoints = 1;
+#ifdef PROFILE
+    std::vector<std::string> m_ProfileStack;
+    std::vector<ProfileNode> m_ProfileNodes;
+    int m_NumProfileNodes = 0;
+#endif
+};
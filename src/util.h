@@ -21,8 +21,93 @@ void RunWorkers(
     boost::asio::thread_pool pool(numWorkers);
     for (int i = 0; i < numWorkers; i++) {
         boost::asio::post(pool, [&, i] {
+            PROFILE_WORKER(i);
             workerFunc(i, numWorkers);
         });
     }
     pool.join();
 }
+
+struct WorkerStats {
+    int tiles = 0;
+    int stolen = 0;
+    double busy = 0;
+    double wall = 0;
+};
+
+using TileFunc = std::function<void(const int, const int)>;
+
+// Runs tileFunc(tile, worker) for every tile in [0, numTiles). Each worker
+// starts with a contiguous range of tiles and, once it runs dry, steals
+// single tiles from the back of the other workers' queues.
+std::vector<WorkerStats> RunTiles(
+    const int numTiles,
+    const TileFunc tileFunc,
+    const int numWorkers = std::thread::hardware_concurrency())
+{
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> tiles;
+    };
+
+    std::vector<Queue> queues(numWorkers);
+    for (int i = 0; i < numTiles; i++) {
+        queues[int64_t(i) * numWorkers / numTiles].tiles.push_back(i);
+    }
+
+    const auto pop = [](Queue &queue, const bool back, int &tile) {
+        std::lock_guard<std::mutex> guard(queue.mutex);
+        if (queue.tiles.empty()) {
+            return false;
+        }
+        if (back) {
+            tile = queue.tiles.back();
+            queue.tiles.pop_back();
+        } else {
+            tile = queue.tiles.front();
+            queue.tiles.pop_front();
+        }
+        return true;
+    };
+
+    std::vector<WorkerStats> stats(numWorkers);
+    const auto startTime = std::chrono::steady_clock::now();
+
+    RunWorkers([&](const int wi, const int wn) {
+        WorkerStats &s = stats[wi];
+        while (true) {
+            int tile;
+            bool stolen = false;
+            if (!pop(queues[wi], false, tile)) {
+                for (int i = 1; i < wn && !stolen; i++) {
+                    stolen = pop(queues[(wi + i) % wn], true, tile);
+                }
+                if (!stolen) {
+                    break;
+                }
+            }
+            const auto tileStart = std::chrono::steady_clock::now();
+            tileFunc(tile, wi);
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - tileStart;
+            s.busy += elapsed.count();
+            s.tiles++;
+            s.stolen += stolen;
+        }
+    }, numWorkers);
+
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - startTime;
+    for (WorkerStats &s : stats) {
+        s.wall = elapsed.count();
+    }
+    return stats;
+}
+
+void PrintWorkerStats(const std::vector<WorkerStats> &stats) {
+    for (int i = 0; i < stats.size(); i++) {
+        const WorkerStats &s = stats[i];
+        fprintf(stderr, "  worker %d: %d tiles (%d stolen), %.1f%% busy\n",
+            i, s.tiles, s.stolen, s.wall > 0 ? 100 * s.busy / s.wall : 0.0);
+    }
+}
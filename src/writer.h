@@ -0,0 +1,340 @@
+#pragma once
+
+// MeshWriters save a mesh as binary STL, binary little-endian PLY or OBJ.
+//
+// The file is sized up front and mapped once, then its records are encoded
+// in chunks on all workers, each straight to its own offset. Formats whose
+// records vary in length (OBJ text) take one more pass to size every chunk
+// before anything is written.
+//
+// A mesh is either indexed (vertices plus triangles) or a soup (three points
+// per triangle), with optionally one color per triangle.
+
+enum class ColorMode {
+    None,       // no colors
+    PerFace,    // each triangle's color
+    PerVertex,  // each vertex gets the mean color of its triangles
+};
+
+class MeshWriter {
+public:
+    virtual ~MeshWriter() {}
+
+    // colors holds one color per triangle, or is empty
+    void Save(
+        const std::string &path,
+        const std::vector<vec3> &vertices, const std::vector<ivec3> &triangles,
+        const std::vector<vec3> &colors, const ColorMode colorMode,
+        const int numWorkers = std::thread::hardware_concurrency()) const
+    {
+        MeshView mesh{vertices, triangles.data(), triangles.size()};
+        Save(path, mesh, colors, colorMode, numWorkers);
+    }
+
+    // points holds three points per triangle
+    void SaveSoup(
+        const std::string &path,
+        const std::vector<vec3> &points,
+        const std::vector<vec3> &colors, const ColorMode colorMode,
+        const int numWorkers = std::thread::hardware_concurrency()) const
+    {
+        MeshView mesh{points, nullptr, points.size() / 3};
+        Save(path, mesh, colors, colorMode, numWorkers);
+    }
+
+protected:
+    static constexpr int kMaxRecordBytes = 128;
+    static constexpr uint64_t kChunkRecords = 1 << 16;
+
+    struct MeshView {
+        const std::vector<vec3> &vertices;
+        const ivec3 *triangles; // null for a soup
+        uint64_t numTriangles;
+        const vec3 *faceColors = nullptr;
+        const vec3 *vertexColors = nullptr;
+
+        ivec3 Triangle(const uint64_t i) const {
+            return triangles ? triangles[i] : ivec3(i * 3, i * 3 + 1, i * 3 + 2);
+        }
+    };
+
+    // a run of records written back to back
+    struct Section {
+        uint64_t count;
+        // bytes per record, or 0 if they vary
+        int size;
+        // encodes record i at dst (at most kMaxRecordBytes), returns its length
+        std::function<int(uint64_t i, uint8_t *dst)> encode;
+    };
+
+    // the colors the format can store, given the ones asked for
+    virtual ColorMode Colors(const ColorMode requested) const = 0;
+
+    virtual std::string Header(const MeshView &mesh) const = 0;
+
+    virtual std::vector<Section> Sections(const MeshView &mesh) const = 0;
+
+    static uint8_t EncodeColor(const real c) {
+        return std::round(glm::clamp(c, real(0), real(1)) * 255);
+    }
+
+private:
+    void Save(
+        const std::string &path, MeshView &mesh,
+        const std::vector<vec3> &colors, ColorMode colorMode,
+        const int numWorkers) const
+    {
+        using namespace boost::interprocess;
+        if (colors.size() < mesh.numTriangles) {
+            colorMode = ColorMode::None;
+        }
+        colorMode = Colors(colorMode);
+        std::vector<vec3> vertexColors;
+        if (colorMode == ColorMode::PerFace) {
+            mesh.faceColors = colors.data();
+        } else if (colorMode == ColorMode::PerVertex) {
+            vertexColors = VertexColors(mesh, colors);
+            mesh.vertexColors = vertexColors.data();
+        }
+
+        const std::string header = Header(mesh);
+        const std::vector<Section> sections = Sections(mesh);
+
+        struct Chunk {
+            int section;
+            uint64_t first;
+            uint64_t last;
+            uint64_t offset;
+        };
+        std::vector<Chunk> chunks;
+        for (int s = 0; s < sections.size(); s++) {
+            for (uint64_t i = 0; i < sections[s].count; i += kChunkRecords) {
+                const uint64_t last = std::min(i + kChunkRecords, sections[s].count);
+                chunks.push_back(Chunk{s, i, last, (last - i) * sections[s].size});
+            }
+        }
+
+        // chunks of varying records are encoded once just to be sized
+        RunWorkers([&](const int wi, const int wn) {
+            std::array<uint8_t, kMaxRecordBytes> scratch;
+            for (int c = wi; c < chunks.size(); c += wn) {
+                Chunk &chunk = chunks[c];
+                const Section &section = sections[chunk.section];
+                if (section.size == 0) {
+                    for (uint64_t i = chunk.first; i < chunk.last; i++) {
+                        chunk.offset += section.encode(i, scratch.data());
+                    }
+                }
+            }
+        }, numWorkers);
+        uint64_t numBytes = header.size();
+        for (Chunk &chunk : chunks) {
+            const uint64_t size = chunk.offset;
+            chunk.offset = numBytes;
+            numBytes += size;
+        }
+
+        {
+            file_mapping::remove(path.c_str());
+            std::filebuf fbuf;
+            fbuf.open(path.c_str(),
+                std::ios_base::in | std::ios_base::out | std::ios_base::trunc |
+                std::ios_base::binary);
+            fbuf.pubseekoff(numBytes - 1, std::ios_base::beg);
+            fbuf.sputc(0);
+        }
+
+        file_mapping fm(path.c_str(), read_write);
+        mapped_region mr(fm, read_write);
+        uint8_t *dst = (uint8_t *)mr.get_address();
+        memcpy(dst, header.data(), header.size());
+
+        RunWorkers([&](const int wi, const int wn) {
+            std::array<uint8_t, kMaxRecordBytes> scratch;
+            for (int c = wi; c < chunks.size(); c += wn) {
+                const Chunk &chunk = chunks[c];
+                const Section &section = sections[chunk.section];
+                uint8_t *p = dst + chunk.offset;
+                for (uint64_t i = chunk.first; i < chunk.last; i++) {
+                    if (section.size) {
+                        section.encode(i, p);
+                        p += section.size;
+                    } else {
+                        const int n = section.encode(i, scratch.data());
+                        memcpy(p, scratch.data(), n);
+                        p += n;
+                    }
+                }
+            }
+        }, numWorkers);
+    }
+
+    static std::vector<vec3> VertexColors(const MeshView &mesh, const std::vector<vec3> &colors) {
+        std::vector<vec3> sums(mesh.vertices.size(), vec3{0});
+        std::vector<int> counts(mesh.vertices.size(), 0);
+        for (uint64_t i = 0; i < mesh.numTriangles; i++) {
+            const ivec3 t = mesh.Triangle(i);
+            for (int k = 0; k < 3; k++) {
+                sums[t[k]] += colors[i];
+                counts[t[k]]++;
+            }
+        }
+        for (int i = 0; i < sums.size(); i++) {
+            if (counts[i] > 0) {
+                sums[i] /= real(counts[i]);
+            }
+        }
+        return sums;
+    }
+};
+
+// 50-byte triangle records; colors only per face, in the 15-bit attribute
+class STLMeshWriter : public MeshWriter {
+protected:
+    ColorMode Colors(const ColorMode requested) const override {
+        return requested == ColorMode::None ? ColorMode::None : ColorMode::PerFace;
+    }
+
+    std::string Header(const MeshView &mesh) const override {
+        std::string header(84, '\0');
+        const uint32_t numTriangles = mesh.numTriangles;
+        memcpy(&header[80], &numTriangles, 4);
+        return header;
+    }
+
+    std::vector<Section> Sections(const MeshView &mesh) const override {
+        return {Section{mesh.numTriangles, 50, [&mesh](const uint64_t i, uint8_t *dst) {
+            const ivec3 t = mesh.Triangle(i);
+            const vec3 points[3] = {mesh.vertices[t.x], mesh.vertices[t.y], mesh.vertices[t.z]};
+            EncodeSTLTriangle(dst, points, mesh.faceColors ? &mesh.faceColors[i] : nullptr);
+            return 50;
+        }}};
+    }
+};
+
+// float positions and int indices, colors as uchar rgb on either element
+class PLYMeshWriter : public MeshWriter {
+protected:
+    ColorMode Colors(const ColorMode requested) const override {
+        return requested;
+    }
+
+    std::string Header(const MeshView &mesh) const override {
+        const std::string rgb =
+            "property uchar red\n"
+            "property uchar green\n"
+            "property uchar blue\n";
+        return
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "element vertex " + std::to_string(mesh.vertices.size()) + "\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n" +
+            (mesh.vertexColors ? rgb : "") +
+            "element face " + std::to_string(mesh.numTriangles) + "\n"
+            "property list uchar int vertex_indices\n" +
+            (mesh.faceColors ? rgb : "") +
+            "end_header\n";
+    }
+
+    std::vector<Section> Sections(const MeshView &mesh) const override {
+        const Section vertices{mesh.vertices.size(), mesh.vertexColors ? 15 : 12,
+            [&mesh](const uint64_t i, uint8_t *dst) {
+                const glm::vec3 p = mesh.vertices[i];
+                memcpy(dst, &p, 12);
+                if (!mesh.vertexColors) {
+                    return 12;
+                }
+                const vec3 &c = mesh.vertexColors[i];
+                dst[12] = EncodeColor(c.r);
+                dst[13] = EncodeColor(c.g);
+                dst[14] = EncodeColor(c.b);
+                return 15;
+            }};
+        const Section faces{mesh.numTriangles, mesh.faceColors ? 16 : 13,
+            [&mesh](const uint64_t i, uint8_t *dst) {
+                const ivec3 t = mesh.Triangle(i);
+                const int32_t indices[3] = {int32_t(t.x), int32_t(t.y), int32_t(t.z)};
+                dst[0] = 3;
+                memcpy(dst + 1, indices, 12);
+                if (!mesh.faceColors) {
+                    return 13;
+                }
+                const vec3 &c = mesh.faceColors[i];
+                dst[13] = EncodeColor(c.r);
+                dst[14] = EncodeColor(c.g);
+                dst[15] = EncodeColor(c.b);
+                return 16;
+            }};
+        return {vertices, faces};
+    }
+};
+
+// text; colors per vertex as the common "v x y z r g b" extension, since
+// per-face colors would need a material library
+class OBJMeshWriter : public MeshWriter {
+protected:
+    ColorMode Colors(const ColorMode requested) const override {
+        return requested == ColorMode::None ? ColorMode::None : ColorMode::PerVertex;
+    }
+
+    std::string Header(const MeshView &mesh) const override {
+        return "# " + std::to_string(mesh.vertices.size()) + " vertices, " +
+            std::to_string(mesh.numTriangles) + " triangles\n";
+    }
+
+    std::vector<Section> Sections(const MeshView &mesh) const override {
+        const Section vertices{mesh.vertices.size(), 0,
+            [&mesh](const uint64_t i, uint8_t *dst) {
+                const glm::vec3 p = mesh.vertices[i];
+                char *s = (char *)dst;
+                if (!mesh.vertexColors) {
+                    return snprintf(s, kMaxRecordBytes, "v %.9g %.9g %.9g\n",
+                        p.x, p.y, p.z);
+                }
+                const vec3 &c = mesh.vertexColors[i];
+                return snprintf(s, kMaxRecordBytes, "v %.9g %.9g %.9g %.4g %.4g %.4g\n",
+                    p.x, p.y, p.z, double(c.r), double(c.g), double(c.b));
+            }};
+        // indices are 1-based
+        const Section faces{mesh.numTriangles, 0,
+            [&mesh](const uint64_t i, uint8_t *dst) {
+                const ivec3 t = mesh.Triangle(i) + 1;
+                return snprintf((char *)dst, kMaxRecordBytes, "f %lld %lld %lld\n",
+                    (long long)t.x, (long long)t.y, (long long)t.z);
+            }};
+        return {vertices, faces};
+    }
+};
+
+// the writer for the path's extension (.stl, .ply or .obj), or null
+std::unique_ptr<MeshWriter> MeshWriterFor(const std::string &path) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".stl") {
+        return std::make_unique<STLMeshWriter>();
+    } else if (ext == ".ply") {
+        return std::make_unique<PLYMeshWriter>();
+    } else if (ext == ".obj") {
+        return std::make_unique<OBJMeshWriter>();
+    }
+    return nullptr;
+}
+
+void SaveBinarySTL(
+    std::string path,
+    const std::vector<vec3> &points,
+    const std::vector<vec3> &colors = std::vector<vec3>{})
+{
+    STLMeshWriter().SaveSoup(path, points, colors, ColorMode::PerFace);
+}
+
+void SaveBinaryPLY(
+    std::string path,
+    const std::vector<vec3> &vertices,
+    const std::vector<ivec3> &triangles,
+    const std::vector<vec3> &colors = std::vector<vec3>{})
+{
+    PLYMeshWriter().Save(path, vertices, triangles, colors, ColorMode::PerFace);
+}
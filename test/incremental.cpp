@@ -0,0 +1,133 @@
+// Checks that --incremental re-meshes only the tiles an edit reaches and that
+// what it writes matches a full run. Exits non-zero on the first failure.
+
+#include "sdf.h"
+
+namespace {
+
+const int kTileSize = 16;
+
+// a body cut by a turned plane, as in main, with a part that can be moved
+SDF3 Scene(const real angle, const vec3 &part) {
+    SDF3 f = Sphere(40).Color({0, 0, 1});
+    f &= Box(vec3(30)).Color({1, 1, 1});
+    f -= Rotate(Cylinder(12).Color({1, 0, 0}), M_PI / 2, X);
+    f &= Rotate(Plane(Y), angle, X).Color({1, 0, 1});
+    f |= Sphere(6, part).Color({0, 1, 0});
+    return f;
+}
+
+struct Run {
+    std::vector<std::array<real, 9>> triangles;
+    int hits = 0;
+    int misses = 0;
+};
+
+// meshes f tile by tile on a grid anchored at the origin, through a
+// TileCache in dir if one is given; triangles come back sorted so runs
+// can be compared whatever order the tiles were meshed in
+Run MeshTiles(const SDF3 &f, const std::string &dir, const Extractor extractor) {
+    const Tape tape(f);
+    const SDF3Node &root = *f.GetNode();
+    const ivec3 lo = ivec3(glm::floor((root.boundLo - real(1)) / real(kTileSize))) * kTileSize;
+    const ivec3 hi = ivec3(glm::ceil((root.boundHi + real(1)) / real(kTileSize))) * kTileSize;
+    const TileGrid grid(lo, hi, kTileSize);
+
+    std::unique_ptr<TileCache> cache;
+    if (!dir.empty()) {
+        cache = std::make_unique<TileCache>(dir, f, HashBytes(&extractor, sizeof(extractor)));
+    }
+
+    Run run;
+    for (int tile = 0; tile < grid.NumTiles(); tile++) {
+        ivec3 a, b;
+        grid.Tile(tile, a, b);
+        TriangleSoup soup;
+        if (cache) {
+            const uint64_t key = cache->Key(a, b);
+            if (!cache->Load(key, soup)) {
+                MeshOctree(tape, a, b, soup, Precision::Double, extractor);
+                cache->Save(key, soup);
+            }
+        } else {
+            MeshOctree(tape, a, b, soup, Precision::Double, extractor);
+        }
+        for (size_t i = 0; i < soup.points.size(); i += 3) {
+            std::array<real, 9> t;
+            for (int j = 0; j < 9; j++) {
+                t[j] = soup.points[i + j / 3][j % 3];
+            }
+            run.triangles.push_back(t);
+        }
+    }
+    std::sort(run.triangles.begin(), run.triangles.end());
+    if (cache) {
+        cache->Prune();
+        run.hits = cache->NumHits();
+        run.misses = cache->NumMisses();
+    }
+    return run;
+}
+
+int failures = 0;
+
+void Check(const bool ok, const char *extractor, const char *what) {
+    printf("%s %s: %s\n", ok ? "ok  " : "FAIL", extractor, what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+}
+
+int main() {
+    const std::string dir =
+        (std::filesystem::temp_directory_path() / "sdf-test-incremental").string();
+
+    for (const Extractor extractor : {Extractor::MarchingCubes, Extractor::DualContouring}) {
+        const char *name = extractor == Extractor::MarchingCubes ? "mc" : "dc";
+        std::filesystem::remove_all(dir);
+
+        const vec3 part(20, 30, 0);
+        const Run first = MeshTiles(Scene(0.3, part), dir, extractor);
+        const int numTiles = first.hits + first.misses;
+        Check(first.hits == 0 && !first.triangles.empty(), name, "first run meshes every tile");
+
+        const Run same = MeshTiles(Scene(0.3, part), dir, extractor);
+        Check(same.misses == 0 && same.triangles == first.triangles, name,
+            "unchanged model reuses every tile");
+
+        // a tile whose triangle count (after the magic and the key) is
+        // corrupt is re-meshed, not loaded
+        for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+            std::fstream file(entry.path(), std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+            const uint64_t count = uint64_t(1) << 60;
+            file.seekp(16);
+            file.write((const char *)&count, sizeof(count));
+            break;
+        }
+        const Run corrupt = MeshTiles(Scene(0.3, part), dir, extractor);
+        Check(corrupt.misses == 1 && corrupt.triangles == first.triangles, name,
+            "corrupt tile is re-meshed");
+
+        // turning the cutting plane re-meshes only the tiles it sweeps
+        // through; the rest of the body, above and below it, is reused
+        const Run turned = MeshTiles(Scene(0.35, part), dir, extractor);
+        Check(turned.triangles == MeshTiles(Scene(0.35, part), "", extractor).triangles, name,
+            "turned plane matches a full run");
+        Check(turned.hits > 0 && turned.misses < numTiles / 2, name,
+            "turned plane reuses the tiles away from it");
+
+        // moving the part outward grows the model's bounds; tiles on the
+        // fixed grid keep their keys so only those near the part change
+        const vec3 moved(20, 30, 34);
+        const Run grown = MeshTiles(Scene(0.35, moved), dir, extractor);
+        Check(grown.triangles == MeshTiles(Scene(0.35, moved), "", extractor).triangles, name,
+            "moved part matches a full run");
+        Check(grown.hits > 0 && grown.misses < numTiles / 2, name,
+            "moved part reuses the tiles away from it");
+    }
+
+    std::filesystem::remove_all(dir);
+    return failures == 0 ? 0 : 1;
+}